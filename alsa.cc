@@ -1,12 +1,15 @@
+#include "replay.h"
 #include "resources.h"
 #include "widget.h"
+#include <algorithm>
 #include <alsa/asoundlib.h>
 
 namespace {
 
-const uint8_t* kVolumeLevel[] = {
-  volume_00, volume_01, volume_02, volume_03, volume_04, volume_05
-};
+// Waves are revealed left to right with the volume.
+const IconFill kVolumeFill = {&volume_waves, nullptr, IconFill::kX, 80, 244};
+const Icon kVolume = {volume.polygons, volume.count, volume.max_points, &kVolumeFill};
+const icon::Registration kRegistration({&kVolume});
 
 void AlsaCheck(int result, const std::string& message) {
   try {
@@ -17,14 +20,77 @@ void AlsaCheck(int result, const std::string& message) {
   }
 }
 
-struct : public Widget {
+struct AlsaWidget : public Widget {
   // TODO(Micha): Replace with RaiiFd
   std::vector<pollfd> pollfds_;
   snd_mixer_t* mixer_;
   snd_mixer_elem_t* master_;
+  std::unique_ptr<replay::Player> player_;
+
+  long min_;
+  long max_;
+  long volume_;
+  bool muted_;
+
+  void Apply(const std::string& key, const std::string& value) {
+    if (replay::kRecording) replay::Record(GetName(), key.c_str(), value);
+    if (key == "min") min_ = std::atol(value.c_str());
+    else if (key == "max") max_ = std::atol(value.c_str());
+    else if (key == "volume") volume_ = std::atol(value.c_str());
+    else if (key == "muted") muted_ = value == "1";
+  }
+
+  // The range only changes with the element info, value changes never query it.
+  void ReadRange() {
+    long min, max;
+    AlsaCheck(snd_mixer_selem_get_playback_volume_range(master_, &min, &max), "Cannot get volume range");
+    if (min != min_) Apply("min", std::to_string(min));
+    if (max != max_) Apply("max", std::to_string(max));
+  }
+
+  // Shows the loudest channel, muted only once every channel is switched off.
+  void ReadVolume() {
+    auto volume = min_;
+    bool muted = snd_mixer_selem_has_playback_switch(master_);
+    for (int i = 0; i <= SND_MIXER_SCHN_LAST; ++i) {
+      auto channel = static_cast<snd_mixer_selem_channel_id_t>(i);
+      if (!snd_mixer_selem_has_playback_channel(master_, channel)) continue;
+      long value;
+      if (snd_mixer_selem_get_playback_volume(master_, channel, &value) >= 0) volume = std::max(volume, value);
+      int on;
+      if (muted && snd_mixer_selem_get_playback_switch(master_, channel, &on) >= 0 && on) muted = false;
+    }
+    if (volume != volume_) Apply("volume", std::to_string(volume));
+    if (muted != muted_) Apply("muted", muted ? "1" : "0");
+  }
+
+  // Called by snd_mixer_handle_events for every change of the master element.
+  static int OnElement(snd_mixer_elem_t* elem, unsigned int mask) {
+    auto self = static_cast<AlsaWidget*>(snd_mixer_elem_get_callback_private(elem));
+    if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+      self->master_ = nullptr;
+      return 0;
+    }
+    try {
+      if (mask & SND_CTL_EVENT_MASK_INFO) self->ReadRange();
+      if (mask & (SND_CTL_EVENT_MASK_INFO | SND_CTL_EVENT_MASK_VALUE)) self->ReadVolume();
+    } catch (const std::exception& ex) {
+      // Must not unwind through the mixer.
+      util::PrintException(ex);
+    }
+    return 0;
+  }
 
   void Init(int argc, char** argv) override {
     // TODO(Micha): Handle arguments
+    min_ = max_ = volume_ = 0;
+    muted_ = false;
+    if (replay::kReplaying) {
+      player_ = std::make_unique<replay::Player>(GetName());
+      Watch(player_->GetFd(), POLLIN);
+      player_->Play([this](const auto& key, const auto& value) { Apply(key, value); });
+      return;
+    }
     static const char kCard[] = "default";
     static const char kChan[] = "Master";
 
@@ -39,27 +105,59 @@ struct : public Widget {
     snd_mixer_selem_id_set_name(sid, kChan);
     master_ = snd_mixer_find_selem(mixer_, sid);
     if (!master_) throw std::runtime_error("Cannot find master volume control");
+    snd_mixer_elem_set_callback_private(master_, this);
+    snd_mixer_elem_set_callback(master_, &AlsaWidget::OnElement);
     pollfds_.resize(snd_mixer_poll_descriptors_count(mixer_));
     AlsaCheck(snd_mixer_poll_descriptors(mixer_, pollfds_.data(), pollfds_.size()), "Cannot get poll descriptors");
+    for (const auto& it : pollfds_)
+      Watch(it.fd, it.events);
+    ReadRange();
+    ReadVolume();
   }
 
-  const uint8_t* GetState() override {
-    long min, max, cur;
-    snd_mixer_selem_get_playback_volume_range(master_, &min, &max);
-    snd_mixer_selem_get_playback_volume(master_, static_cast<snd_mixer_selem_channel_id_t>(0), &cur);
-    auto vol_images = util::Length(kVolumeLevel);
-    return kVolumeLevel[vol_images * cur / (max - min + 1)];
+  IconState GetState() override {
+    return {&kVolume, static_cast<uint8_t>(muted_ ? 0 : icon::Level(volume_, min_, max_))};
   }
 
-  std::vector<pollfd> GetPollFds() override {
-    return pollfds_;
+  void Activate() override {
   }
 
-  void Activate() override {
+  // Mixer events queue up in the kernel while the icon is hidden. Once shown they are handled first,
+  // and the volume is read again in case the queue overflowed.
+  void SetVisible(bool visible) override {
+    if (player_) return;
+    for (const auto& it : pollfds_) {
+      if (visible) Watch(it.fd, it.events);
+      else Unwatch(it.fd);
+    }
+    if (!visible) return;
+    Handle({-1, 0, 0});
+    if (!master_) return;
+    ReadRange();
+    ReadVolume();
   }
 
+  const char* GetName() override {
+    return "alsa";
+  }
+
+  // Runs for every ready descriptor of a batch. The first call polls all of them, so events are
+  // handled once and later calls find nothing left.
   void Handle(const pollfd&) override {
-    snd_mixer_handle_events(mixer_);
+    if (player_) {
+      player_->Play([this](const auto& key, const auto& value) { Apply(key, value); });
+      return;
+    }
+    if (poll(pollfds_.data(), pollfds_.size(), 0) <= 0) return;
+    unsigned short revents;
+    AlsaCheck(snd_mixer_poll_descriptors_revents(mixer_, pollfds_.data(), pollfds_.size(), &revents),
+              "Cannot get mixer poll events");
+    if (revents & POLLIN) AlsaCheck(snd_mixer_handle_events(mixer_), "Cannot handle mixer events");
+  }
+
+  // Loading the mixer talks to the sound server.
+  bool MayBlock() override {
+    return true;
   }
 } __impl__;
 
@@ -1,8 +1,13 @@
+#include "replay.h"
 #include "resources.h"
 #include "widget.h"
+#include <cerrno>
 #include <cstring>
 #include <memory>
+#include <vector>
 #include <libudev.h>
+#include <linux/filter.h>
+#include <sys/socket.h>
 
 namespace libudev {
 
@@ -14,22 +19,38 @@ using Device = std::unique_ptr<udev_device, decltype(&udev_device_unref)>;
 
 namespace {
 
-const uint8_t* kChargeLevel[] = {
-  battery_00c, battery_01c, battery_02c, battery_03c, battery_04c,
-  battery_05c, battery_06c, battery_07c, battery_08c, battery_09c
-};
-
-const uint8_t* kDrainLevel[] = {
-  battery_00d, battery_01d, battery_02d, battery_03d, battery_04d,
-  battery_05d, battery_06d, battery_07d, battery_08d, battery_09c
-};
-
-// TODO(Micha): Why util::Length does not work here?
-constexpr auto kNumStates = sizeof(kChargeLevel) / sizeof(*kChargeLevel);
-static_assert(kNumStates == sizeof(kDrainLevel) / sizeof(*kDrainLevel),
-              "Mismatching number of battery charge levels");
-
-const char kDeviceRoot[] = "/sys/class/power_supply";
+// Charge fills the battery bottom up, the bolt shows inverted where the charge covers it.
+const IconFill kChargeFill = {&battery_fill, &battery_bolt, IconFill::kY, 192, 48};
+const IconFill kDrainFill = {&battery_fill, nullptr, IconFill::kY, 192, 48};
+const Icon kCharging = {battery.polygons, battery.count, battery.max_points, &kChargeFill};
+const Icon kDraining = {battery.polygons, battery.count, battery.max_points, &kDrainFill};
+const icon::Registration kRegistration({&kCharging, &kDraining});
+
+// Socket filter passing datagrams that start with prefix, compared a word at a time. Kernel uevents
+// start with action@devpath, so the kernel drops events of every other device before waking us up.
+std::vector<sock_filter> MatchPrefix(const std::string& prefix) {
+  std::vector<sock_filter> result;
+  for (size_t offset = 0; offset < prefix.size();) {
+    auto left = prefix.size() - offset;
+    size_t bytes = left >= 4 ? 4 : left >= 2 ? 2 : 1;
+    uint32_t value = 0;
+    for (size_t i = 0; i < bytes; ++i)
+      value = value << 8 | static_cast<uint8_t>(prefix[offset + i]);
+    uint16_t size = bytes == 4 ? BPF_W : bytes == 2 ? BPF_H : BPF_B;
+    result.push_back(BPF_STMT(BPF_LD | size | BPF_ABS, static_cast<uint32_t>(offset)));
+    result.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0));
+    offset += bytes;
+  }
+  result.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+  result.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+  // Mismatches jump to the final reject.
+  for (size_t i = 1; i + 2 < result.size(); i += 2) {
+    auto distance = result.size() - i - 2;
+    if (distance > 255) throw std::runtime_error("Device path is too long for a uevent filter");
+    result[i].jf = static_cast<uint8_t>(distance);
+  }
+  return result;
+}
 
 struct : public Widget {
   const char* device_name_{"BAT1"};
@@ -37,46 +58,111 @@ struct : public Widget {
   libudev::Context udev_{nullptr, udev_unref};
   libudev::Monitor monitor_{nullptr, udev_monitor_unref};
   int fd_;
+  std::vector<sock_filter> filter_;
+  std::unique_ptr<util::PolledFile> status_;
+  std::unique_ptr<util::PolledFile> charge_now_;
+  std::unique_ptr<util::PolledFile> charge_full_;
+
+  std::unique_ptr<replay::Player> player_;
 
   bool charging_;
   int current_;
   int total_;
 
+  // Replayed inputs, recorded the way sysfs reports them.
+  void Apply(const std::string& key, const std::string& value) {
+    if (key == "status") charging_ = value == "Charging";
+    else if (key == "charge_now") current_ = std::atoi(value.c_str());
+    else if (key == "charge_full") total_ = std::atoi(value.c_str());
+  }
+
+  void Attach(std::vector<sock_filter>& filter) {
+    sock_fprog program = {static_cast<unsigned short>(filter.size()), filter.data()};
+    if (setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+      util::ThrowSystemError("Failed to attach uevent filter");
+  }
+
+  // Attributes are parsed in place, values only become strings when recording.
+  void Read() {
+    auto status = status_->Read();
+    charging_ = !std::strcmp(status, "Charging");
+    current_ = charge_now_->ReadLong();
+    total_ = charge_full_->ReadLong();
+    if (!replay::kRecording) return;
+    replay::Record(GetName(), "status", status);
+    replay::Record(GetName(), "charge_now", std::to_string(current_));
+    replay::Record(GetName(), "charge_full", std::to_string(total_));
+  }
+
   void Init(int argc, char** argv) override {
     // TODO(Micha): Handle arguments
-    const auto& base_path = std::string(kDeviceRoot) + "/" + device_name_ + "/";
-    charging_ = util::ReadFile(base_path + "status") == "Charging\n";
-    current_ = std::atoi(util::ReadFile(base_path + "charge_now").c_str());
-    total_ = std::atoi(util::ReadFile(base_path + "charge_full").c_str());
+    if (replay::kReplaying) {
+      player_ = std::make_unique<replay::Player>(GetName());
+      Watch(player_->GetFd(), POLLIN);
+      player_->Play([this](const auto& key, const auto& value) { Apply(key, value); });
+      return;
+    }
     udev_.reset(udev_new());
-
     if (!udev_) throw std::runtime_error("Failed to create udev context");
-    monitor_.reset(udev_monitor_new_from_netlink(udev_.get(), "udev"));
+    libudev::Device device(udev_device_new_from_subsystem_sysname(udev_.get(), "power_supply", device_name_),
+                           udev_device_unref);
+    if (!device) throw std::runtime_error(std::string("Failed to find power supply ") + device_name_);
+    std::string syspath = udev_device_get_syspath(device.get());
+    status_ = std::make_unique<util::PolledFile>(syspath + "/status");
+    charge_now_ = std::make_unique<util::PolledFile>(syspath + "/charge_now");
+    charge_full_ = std::make_unique<util::PolledFile>(syspath + "/charge_full");
+
+    // Kernel events carry the device path up front, unlike the ones udev forwards.
+    monitor_.reset(udev_monitor_new_from_netlink(udev_.get(), "kernel"));
     if (!monitor_) throw std::runtime_error("Failed to create udev monitor");
-    if (udev_monitor_filter_add_match_subsystem_devtype(monitor_.get(), "power_supply", nullptr) < 0)
-      throw std::runtime_error("Failed to add udev devtype filter");
     fd_ = udev_monitor_get_fd(monitor_.get());
-    udev_monitor_enable_receiving(monitor_.get());
+    if (udev_monitor_enable_receiving(monitor_.get()) < 0)
+      throw std::runtime_error("Failed to enable udev monitor");
+    auto prefix = std::string("change@") + udev_device_get_devpath(device.get());
+    filter_ = MatchPrefix(prefix.append(1, '\0'));
+    Attach(filter_);
+    Watch(fd_, POLLIN);
+    Read();
   }
 
-  const uint8_t* GetState() override {
-    auto source = charging_ ? kChargeLevel : kDrainLevel;
-    return source[kNumStates * current_ / total_];
+  IconState GetState() override {
+    return {charging_ ? &kCharging : &kDraining, icon::Level(current_, 0, total_)};
   }
 
-  std::vector<pollfd> GetPollFds() override {
-    return {{fd_, POLLIN}};
+  void Activate() override {
   }
 
-  void Activate() override {
+  // Hidden icons swap in a filter dropping every uevent, the charge is read again once shown.
+  void SetVisible(bool visible) override {
+    if (!monitor_) return;
+    if (visible) {
+      Attach(filter_);
+      Read();
+      return;
+    }
+    std::vector<sock_filter> reject = {BPF_STMT(BPF_RET | BPF_K, 0)};
+    Attach(reject);
+  }
+
+  const char* GetName() override {
+    return "battery";
   }
 
   void Handle(const pollfd&) override {
-    libudev::Device device(udev_monitor_receive_device(monitor_.get()), udev_device_unref);
-    if (std::strcmp(udev_device_get_sysname(device.get()), device_name_)) return;
-    charging_ = !std::strcmp(udev_device_get_property_value(device.get(), "POWER_SUPPLY_STATUS"), "Charging");
-    current_ = std::atoi(udev_device_get_property_value(device.get(), "POWER_SUPPLY_CHARGE_NOW"));
-    total_ = std::atoi(udev_device_get_property_value(device.get(), "POWER_SUPPLY_CHARGE_FULL"));
+    if (player_) {
+      player_->Play([this](const auto& key, const auto& value) { Apply(key, value); });
+      return;
+    }
+    // Only changes of our device pass the filter, they are drained unparsed and sysfs is read once.
+    while (recv(fd_, nullptr, 0, MSG_DONTWAIT | MSG_TRUNC) >= 0) {}
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+      util::ThrowSystemError("Failed to receive uevent");
+    Read();
+  }
+
+  // Sysfs reads of some batteries go through slow firmware calls.
+  bool MayBlock() override {
+    return true;
   }
 } __impl__;
 
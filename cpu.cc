@@ -0,0 +1,99 @@
+#include "replay.h"
+#include "resources.h"
+#include "sample.h"
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+// Load fills the chip bottom up.
+const IconFill kLoadFill = {&cpu_fill, nullptr, IconFill::kY, 168, 88};
+const Icon kLoad = {cpu.polygons, cpu.count, cpu.max_points, &kLoadFill};
+const icon::Registration kRegistration({&kLoad});
+
+const int kInterval = 2000;
+const int kSlack = 500;
+// Samples of the trend, a little over an hour at the interval above.
+const size_t kHistory = 2048;
+
+struct CpuWidget : public sample::SampledWidget {
+  std::unique_ptr<util::PolledFile> stat_;
+  std::unique_ptr<replay::Player> player_;
+  history::Ring history_{kHistory};
+
+  unsigned long long busy_{0};
+  unsigned long long total_{0};
+  uint8_t level_{0};
+  unsigned long long replayed_busy_{0};
+
+  // Load since the previous sample.
+  void Update(unsigned long long busy, unsigned long long total) {
+    level_ = icon::Level(busy - busy_, 0, total - total_);
+    busy_ = busy;
+    total_ = total;
+    history_.Push(level_);
+  }
+
+  // Counters are recorded as read, the total completes a sample.
+  void Apply(const std::string& key, const std::string& value) {
+    if (key == "busy") replayed_busy_ = std::strtoull(value.c_str(), nullptr, 10);
+    else if (key == "total") Update(replayed_busy_, std::strtoull(value.c_str(), nullptr, 10));
+  }
+
+  // Aggregate line of all cpus: user nice system idle iowait irq softirq steal. Guest time is
+  // accounted in user already.
+  bool Sample() override {
+    auto ptr = stat_->Read();
+    if (std::strncmp(ptr, "cpu ", 4)) throw std::runtime_error("Unexpected format of /proc/stat");
+    ptr += 4;
+    unsigned long long fields[8] = {};
+    unsigned long long total = 0;
+    for (auto& it : fields) {
+      char* end;
+      it = std::strtoull(ptr, &end, 10);
+      ptr = end;
+      total += it;
+    }
+    auto busy = total - fields[3] - fields[4];
+    if (replay::kRecording) {
+      replay::Record(GetName(), "busy", std::to_string(busy));
+      replay::Record(GetName(), "total", std::to_string(total));
+    }
+    Update(busy, total);
+    // Every sample extends the history, even if the level stays the same.
+    return true;
+  }
+
+  void Init(int argc, char** argv) override {
+    if (replay::kReplaying) {
+      player_ = std::make_unique<replay::Player>(GetName());
+      Watch(player_->GetFd(), POLLIN);
+      player_->Play([this](const auto& key, const auto& value) { Apply(key, value); });
+      return;
+    }
+    stat_ = std::make_unique<util::PolledFile>("/proc/stat", 4096);
+    Start(kInterval, kSlack);
+  }
+
+  IconState GetState() override {
+    return {&kLoad, level_};
+  }
+
+  const history::Ring* GetHistory() override {
+    return &history_;
+  }
+
+  void Activate() override {
+  }
+
+  const char* GetName() override {
+    return "cpu";
+  }
+
+  void Handle(const pollfd&) override {
+    if (player_) player_->Play([this](const auto& key, const auto& value) { Apply(key, value); });
+  }
+} __impl__;
+
+}  // namespace
@@ -1,6 +1,13 @@
 #include "dbus.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
 #include <iostream>
 #include <map>
+#include <system_error>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 namespace {
 
@@ -17,12 +24,37 @@ void ParseBasic(dbus::Tree& self, DBusMessageIter& iter) {
   auto type = dbus_message_iter_get_arg_type(&iter);
   switch (dbus_message_iter_get_arg_type(&iter)) {
     case DBUS_TYPE_OBJECT_PATH:
+    case DBUS_TYPE_SIGNATURE:
     case DBUS_TYPE_STRING:
       self.emplace_back(std::string(), dbus::Tree(GetBasic<char*>(iter)));
       break;
     case DBUS_TYPE_BYTE:
       self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<uint8_t>(iter))));
       break;
+    case DBUS_TYPE_BOOLEAN:
+      self.emplace_back(std::string(), dbus::Tree(GetBasic<dbus_bool_t>(iter) ? "true" : "false"));
+      break;
+    case DBUS_TYPE_INT16:
+      self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<dbus_int16_t>(iter))));
+      break;
+    case DBUS_TYPE_UINT16:
+      self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<dbus_uint16_t>(iter))));
+      break;
+    case DBUS_TYPE_INT32:
+      self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<dbus_int32_t>(iter))));
+      break;
+    case DBUS_TYPE_UINT32:
+      self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<dbus_uint32_t>(iter))));
+      break;
+    case DBUS_TYPE_INT64:
+      self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<dbus_int64_t>(iter))));
+      break;
+    case DBUS_TYPE_UINT64:
+      self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<dbus_uint64_t>(iter))));
+      break;
+    case DBUS_TYPE_DOUBLE:
+      self.emplace_back(std::string(), dbus::Tree(std::to_string(GetBasic<double>(iter))));
+      break;
     default:
       const std::string message("Type not implemented: ");
       throw std::runtime_error(message + static_cast<char>(type));
@@ -46,6 +78,14 @@ void ParseArray(dbus::Tree& self, DBusMessageIter& iter) {
   }
 }
 
+void ParseStruct(dbus::Tree& self, DBusMessageIter& iter) {
+  DBusMessageIter sub;
+  dbus_message_iter_recurse(&iter, &sub);
+  dbus::Tree subtree;
+  ParseImpl(subtree, sub);
+  self.emplace_back(std::string(), subtree);
+}
+
 void ParseDictEntry(dbus::Tree& self, DBusMessageIter& iter) {
   DBusMessageIter sub;
   dbus_message_iter_recurse(&iter, &sub);
@@ -64,6 +104,7 @@ void ParseImpl(dbus::Tree& self, DBusMessageIter& iter) {
   static const std::map<int, void(*)(dbus::Tree&, DBusMessageIter&)> kHandlers = {
     {DBUS_TYPE_VARIANT, ParseVariant},
     {DBUS_TYPE_ARRAY, ParseArray},
+    {DBUS_TYPE_STRUCT, ParseStruct},
     {DBUS_TYPE_DICT_ENTRY, ParseDictEntry}
   };
   for (;;) {
@@ -75,6 +116,34 @@ void ParseImpl(dbus::Tree& self, DBusMessageIter& iter) {
   }
 }
 
+void OnPendingCallNotify(DBusPendingCall* pending, void* data) {
+  try {
+    auto callback = static_cast<dbus::Callback*>(data);
+    (*callback)(dbus::Message(dbus_pending_call_steal_reply(pending)));
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+  }
+}
+
+void FreeCallback(void* data) {
+  delete static_cast<dbus::Callback*>(data);
+}
+
+// Route key hashing straight from the message strings, nothing is copied per signal.
+size_t HashRoute(const char* path, const char* iface, const char* member) {
+  size_t result = 14695981039346656037ull;
+  for (auto it : {path, iface, member}) {
+    for (; *it; ++it)
+      result = (result ^ static_cast<unsigned char>(*it)) * 1099511628211ull;
+    result = (result ^ 0xff) * 1099511628211ull;
+  }
+  return result;
+}
+
+int GetTimeoutFd(DBusTimeout* timeout) {
+  return static_cast<int>(reinterpret_cast<intptr_t>(dbus_timeout_get_data(timeout)));
+}
+
 }  // namespace
 
 namespace dbus {
@@ -145,6 +214,178 @@ Watch::operator DBusWatch*() {
   return impl_;
 }
 
+Dispatcher::Dispatcher(Connection& conn, event::Source& source) :
+    conn_(conn),
+    source_(source),
+    wakeup_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+  if (wakeup_fd_ < 0) util::ThrowSystemError("Failed to create dispatch eventfd");
+  try {
+    source_.Watch(wakeup_fd_, POLLIN);
+    if (!dbus_connection_set_watch_functions(conn_, OnAddWatch, OnRemoveWatch, OnToggleWatch, this, nullptr))
+      throw std::runtime_error("Failed to setup dbus watch functions");
+    if (!dbus_connection_set_timeout_functions(conn_, OnAddTimeout, OnRemoveTimeout, OnToggleTimeout, this, nullptr))
+      throw std::runtime_error("Failed to setup dbus timeout functions");
+    dbus_connection_set_dispatch_status_function(conn_, OnDispatchStatus, this, nullptr);
+    // Messages might have been queued before the status function was installed.
+    OnDispatchStatus(conn_, dbus_connection_get_dispatch_status(conn_), this);
+  } catch (const std::exception&) {
+    Detach();
+    throw;
+  }
+}
+
+Dispatcher::~Dispatcher() {
+  Detach();
+}
+
+// Resetting the functions makes libdbus remove everything it added through them.
+void Dispatcher::Detach() {
+  dbus_connection_set_dispatch_status_function(conn_, nullptr, nullptr, nullptr);
+  dbus_connection_set_timeout_functions(conn_, nullptr, nullptr, nullptr, nullptr, nullptr);
+  dbus_connection_set_watch_functions(conn_, nullptr, nullptr, nullptr, nullptr, nullptr);
+  for (const auto& it : timeouts_) {
+    source_.Unwatch(it.first);
+    close(it.first);
+  }
+  timeouts_.clear();
+  for (auto& it : watches_)
+    source_.Unwatch(it.GetFd());
+  watches_.clear();
+  source_.Unwatch(wakeup_fd_);
+  close(wakeup_fd_);
+}
+
+// Read and write watches may share a descriptor, register their union.
+void Dispatcher::UpdateWatches(int fd) {
+  short events = 0;
+  for (auto& it : watches_) {
+    if (it.GetFd() != fd || !it.IsEnabled()) continue;
+    auto flags = dbus_watch_get_flags(it);
+    if (flags & DBUS_WATCH_READABLE) events |= POLLIN;
+    if (flags & DBUS_WATCH_WRITABLE) events |= POLLOUT;
+  }
+  if (events) source_.Watch(fd, events);
+  else source_.Unwatch(fd);
+}
+
+void Dispatcher::UpdateTimeout(DBusTimeout* timeout) {
+  itimerspec spec = {{0, 0}, {0, 0}};
+  if (dbus_timeout_get_enabled(timeout)) {
+    auto interval = dbus_timeout_get_interval(timeout);
+    spec.it_value = {interval / 1000, interval % 1000 * 1000000};
+    spec.it_interval = spec.it_value;
+  }
+  if (timerfd_settime(GetTimeoutFd(timeout), 0, &spec, nullptr) < 0)
+    util::ThrowSystemError("Failed to arm dbus timeout");
+}
+
+void Dispatcher::Dispatch() {
+  while (dbus_connection_dispatch(conn_) == DBUS_DISPATCH_DATA_REMAINS);
+}
+
+bool Dispatcher::Handle(const pollfd& fd) {
+  uint64_t counter;
+  if (fd.fd == wakeup_fd_) {
+    if (read(wakeup_fd_, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+      util::ThrowSystemError("Failed to read dispatch eventfd");
+    Dispatch();
+    return true;
+  }
+  auto timeout = timeouts_.find(fd.fd);
+  if (timeout != timeouts_.end()) {
+    if (read(fd.fd, &counter, sizeof(counter)) == sizeof(counter))
+      dbus_timeout_handle(timeout->second);
+    Dispatch();
+    return true;
+  }
+  unsigned int flags = 0;
+  if (fd.revents & POLLIN) flags |= DBUS_WATCH_READABLE;
+  if (fd.revents & POLLOUT) flags |= DBUS_WATCH_WRITABLE;
+  if (fd.revents & POLLERR) flags |= DBUS_WATCH_ERROR;
+  if (fd.revents & POLLHUP) flags |= DBUS_WATCH_HANGUP;
+  auto watch = std::find_if(watches_.begin(), watches_.end(), [&fd, flags](auto& op) {
+    return op.GetFd() == fd.fd && op.IsEnabled() && (dbus_watch_get_flags(op) | DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP) & flags;
+  });
+  if (watch == watches_.end()) return false;
+  // Handling may remove watches, the other one sharing this descriptor fires on the next wakeup.
+  dbus_watch_handle(*watch, flags);
+  Dispatch();
+  return true;
+}
+
+dbus_bool_t Dispatcher::OnAddWatch(DBusWatch* watch, void* data) {
+  try {
+    auto self = static_cast<Dispatcher*>(data);
+    self->watches_.push_back(watch);
+    self->UpdateWatches(dbus_watch_get_unix_fd(watch));
+    return true;
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+    return false;
+  }
+}
+
+void Dispatcher::OnRemoveWatch(DBusWatch* watch, void* data) {
+  try {
+    auto self = static_cast<Dispatcher*>(data);
+    self->watches_.remove(watch);
+    self->UpdateWatches(dbus_watch_get_unix_fd(watch));
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+  }
+}
+
+void Dispatcher::OnToggleWatch(DBusWatch* watch, void* data) {
+  try {
+    auto self = static_cast<Dispatcher*>(data);
+    self->UpdateWatches(dbus_watch_get_unix_fd(watch));
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+  }
+}
+
+dbus_bool_t Dispatcher::OnAddTimeout(DBusTimeout* timeout, void* data) {
+  auto self = static_cast<Dispatcher*>(data);
+  auto fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) return false;
+  try {
+    dbus_timeout_set_data(timeout, reinterpret_cast<void*>(static_cast<intptr_t>(fd)), nullptr);
+    self->timeouts_[fd] = timeout;
+    self->UpdateTimeout(timeout);
+    self->source_.Watch(fd, POLLIN);
+    return true;
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+    self->timeouts_.erase(fd);
+    close(fd);
+    return false;
+  }
+}
+
+void Dispatcher::OnRemoveTimeout(DBusTimeout* timeout, void* data) {
+  auto self = static_cast<Dispatcher*>(data);
+  auto fd = GetTimeoutFd(timeout);
+  if (!self->timeouts_.erase(fd)) return;
+  self->source_.Unwatch(fd);
+  close(fd);
+}
+
+void Dispatcher::OnToggleTimeout(DBusTimeout* timeout, void* data) {
+  try {
+    static_cast<Dispatcher*>(data)->UpdateTimeout(timeout);
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+  }
+}
+
+// Called from inside libdbus, dispatching is deferred to the reactor.
+void Dispatcher::OnDispatchStatus(DBusConnection*, DBusDispatchStatus status, void* data) {
+  if (status != DBUS_DISPATCH_DATA_REMAINS) return;
+  uint64_t counter = 1;
+  if (write(static_cast<Dispatcher*>(data)->wakeup_fd_, &counter, sizeof(counter)) < 0)
+    util::PrintException(std::system_error(errno, std::system_category(), "Failed to wake up dispatcher"));
+}
+
 Message::Message(DBusMessage* op, DtorPtr dtor) :
     Base(op, dtor) {}
 
@@ -165,7 +406,23 @@ Message Request(Connection& conn, Message& req) {
   return reply;
 }
 
+void RequestAsync(Connection& conn, Message& req, Callback callback) {
+  DBusPendingCall* pending = nullptr;
+  if (!dbus_connection_send_with_reply(conn, req, &pending, DBUS_TIMEOUT_USE_DEFAULT) || !pending)
+    throw std::runtime_error("Failed to send request");
+  auto data = new Callback(std::move(callback));
+  if (!dbus_pending_call_set_notify(pending, OnPendingCallNotify, data, FreeCallback)) {
+    delete data;
+    dbus_pending_call_cancel(pending);
+    dbus_pending_call_unref(pending);
+    throw std::runtime_error("Failed to set reply notification");
+  }
+  // Connection holds its own reference until the call completes.
+  dbus_pending_call_unref(pending);
+}
+
 Tree Parse(Message&& op) {
+  ThrowIfError(op);
   Tree result;
   DBusMessageIter iter;
   dbus_message_iter_init(op, &iter);
@@ -180,4 +437,106 @@ void DumpTree(const Tree& tree, int depth) {
   }
 }
 
+void ThrowIfError(DBusMessage* message) {
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_ERROR) return;
+  Error error;
+  dbus_set_error_from_message(error, message);
+  throw error;
+}
+
+void CheckType(DBusMessageIter& iter, int expected) {
+  auto type = dbus_message_iter_get_arg_type(&iter);
+  if (type == expected) return;
+  const std::string message("Type mismatch, expected ");
+  throw std::runtime_error(message + static_cast<char>(expected) + " got " +
+                           (type == DBUS_TYPE_INVALID ? std::string("nothing") : std::string(1, type)));
+}
+
+Bus::Bus() :
+    last_id_(0) {}
+
+// Watches belong to the reactor they were registered with, the dispatcher is recreated on rebinding.
+void Bus::Bind(event::Reactor* reactor) {
+  dispatcher_.reset();
+  source_ = event::Source(reactor, this);
+  if (reactor && connection_) dispatcher_ = std::make_unique<Dispatcher>(*connection_, source_);
+}
+
+Connection& Bus::GetConnection() {
+  if (connection_) return *connection_;
+  auto connection = std::make_unique<Connection>(DBUS_BUS_SYSTEM);
+  // The shared connection would otherwise exit the process when the bus goes away.
+  dbus_connection_set_exit_on_disconnect(*connection, false);
+  if (!dbus_connection_add_filter(*connection, OnMessage, this, nullptr))
+    throw std::runtime_error("Failed to add dbus filter");
+  connection_ = std::move(connection);
+  dispatcher_ = std::make_unique<Dispatcher>(*connection_, source_);
+  return *connection_;
+}
+
+// Without an error argument the match is sent without waiting for the reply.
+unsigned long Bus::Subscribe(const std::string& path, const char* iface, const char* member, Handler handler) {
+  auto rule = std::string("type='signal',interface='") + iface + "',member='" + member + "'";
+  if (!path.empty()) rule += ",path='" + path + "'";
+  auto& conn = GetConnection();
+  if (!rules_[rule]++) dbus_bus_add_match(conn, rule.c_str(), nullptr);
+  auto id = ++last_id_;
+  routes_.emplace(HashRoute(path.c_str(), iface, member), Route{id, path, iface, member, rule, std::move(handler)});
+  return id;
+}
+
+void Bus::Unsubscribe(unsigned long id) {
+  auto route = std::find_if(routes_.begin(), routes_.end(), [id](const auto& op) {
+    return op.second.id == id;
+  });
+  if (route == routes_.end()) return;
+  auto rule = rules_.find(route->second.rule);
+  if (rule != rules_.end() && !--rule->second) {
+    if (connection_) dbus_bus_remove_match(*connection_, rule->first.c_str(), nullptr);
+    rules_.erase(rule);
+  }
+  routes_.erase(route);
+}
+
+void Bus::Handle(const pollfd& fd) {
+  if (dispatcher_) dispatcher_->Handle(fd);
+}
+
+// Handlers may subscribe and unsubscribe, so matches are collected first and looked up again
+// before every call.
+void Bus::Deliver(DBusMessage* message) {
+  auto path = dbus_message_get_path(message);
+  auto iface = dbus_message_get_interface(message);
+  auto member = dbus_message_get_member(message);
+  if (!path || !iface || !member) return;
+  std::vector<unsigned long> ids;
+  for (auto hash : {HashRoute(path, iface, member), HashRoute("", iface, member)}) {
+    auto range = routes_.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      const auto& route = it->second;
+      if ((route.path.empty() || route.path == path) && route.iface == iface && route.member == member)
+        ids.push_back(route.id);
+    }
+  }
+  for (auto id : ids) {
+    auto route = std::find_if(routes_.begin(), routes_.end(), [id](const auto& op) {
+      return op.second.id == id;
+    });
+    if (route == routes_.end()) continue;
+    auto handler = route->second.handler;
+    try {
+      handler(message);
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+    }
+  }
+}
+
+// Replies and other messages are left to libdbus.
+DBusHandlerResult Bus::OnMessage(DBusConnection*, DBusMessage* message, void* data) {
+  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL)
+    static_cast<Bus*>(data)->Deliver(message);
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
 }  // namespace dbus
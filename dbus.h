@@ -1,9 +1,17 @@
 #ifndef LAPS2_DBUS_H_
 #define LAPS2_DBUS_H_
 
+#include "event.h"
 #include "util.h"
 #include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <list>
 #include <memory>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <dbus/dbus.h>
 
@@ -42,6 +50,36 @@ struct Watch : public util::Holder<DBusWatch> {
   operator DBusWatch*();
 };
 
+// Drives a connection from the reactor: watches, timeouts and dispatching of queued messages.
+// Descriptors are registered through the owner's source, which forwards their events to Handle.
+class Dispatcher : public util::NonCopyable {
+ private:
+  Connection& conn_;
+  event::Source& source_;
+  std::list<Watch> watches_;
+  std::unordered_map<int, DBusTimeout*> timeouts_;
+  int wakeup_fd_;
+
+  void UpdateWatches(int fd);
+  void UpdateTimeout(DBusTimeout* timeout);
+  void Dispatch();
+  void Detach();
+
+  static dbus_bool_t OnAddWatch(DBusWatch* watch, void* data);
+  static void OnRemoveWatch(DBusWatch* watch, void* data);
+  static void OnToggleWatch(DBusWatch* watch, void* data);
+  static dbus_bool_t OnAddTimeout(DBusTimeout* timeout, void* data);
+  static void OnRemoveTimeout(DBusTimeout* timeout, void* data);
+  static void OnToggleTimeout(DBusTimeout* timeout, void* data);
+  static void OnDispatchStatus(DBusConnection* conn, DBusDispatchStatus status, void* data);
+
+ public:
+  Dispatcher(Connection& conn, event::Source& source);
+  ~Dispatcher();
+  // Returns false if the descriptor does not belong to this connection.
+  bool Handle(const pollfd& fd);
+};
+
 struct Message : public util::Holder<DBusMessage> {
   Message(DBusMessage* op, DtorPtr dtor = dbus_message_unref);
   operator DBusMessage*();
@@ -53,9 +91,233 @@ struct Tree : public std::vector<std::pair<std::string, Tree>> {
   Tree(const_iterator a, const_iterator b);
 };
 
+using Callback = std::function<void(Message&& reply)>;
+
 Message Request(Connection& conn, Message& req);
+// Does not block, the callback is invoked from dispatch once the reply arrives.
+void RequestAsync(Connection& conn, Message& req, Callback callback);
 Tree Parse(Message&& op);
 void DumpTree(const Tree& tree, int depth = 0);
+void ThrowIfError(DBusMessage* message);
+void CheckType(DBusMessageIter& iter, int expected);
+
+// Process wide system bus connection shared by all widgets. Signals are routed to subscribers
+// by path, interface and member, identical match rules are sent to the bus daemon only once.
+class Bus : public event::Handler, public util::Singleton<Bus> {
+ public:
+  using Handler = std::function<void(DBusMessage* message)>;
+
+ private:
+  struct Route {
+    unsigned long id;
+    std::string path;
+    std::string iface;
+    std::string member;
+    std::string rule;
+    Handler handler;
+  };
+
+  event::Source source_;
+  std::unique_ptr<Connection> connection_;
+  std::unique_ptr<Dispatcher> dispatcher_;
+  std::unordered_multimap<size_t, Route> routes_;
+  std::unordered_map<std::string, unsigned> rules_;
+  unsigned long last_id_;
+
+  void Deliver(DBusMessage* message);
+  static DBusHandlerResult OnMessage(DBusConnection* conn, DBusMessage* message, void* data);
+
+ public:
+  Bus();
+  // Must be called before the first use, the connection is established on demand.
+  void Bind(event::Reactor* reactor);
+  Connection& GetConnection();
+  // Empty path receives the signal from any object. Handlers are invoked from dispatch.
+  unsigned long Subscribe(const std::string& path, const char* iface, const char* member, Handler handler);
+  void Unsubscribe(unsigned long id);
+  void Handle(const pollfd& fd) override;
+};
+
+// Typed decoding of message arguments without intermediate copies. Strings and containers
+// point into the message and are only valid as long as it is alive.
+struct StringView {
+  const char* data;
+  size_t size;
+
+  bool operator==(const char* op) const { return !std::strcmp(data, op); }
+  bool operator!=(const char* op) const { return !(*this == op); }
+  bool operator==(const std::string& op) const { return op.size() == size && !op.compare(0, size, data, size); }
+  bool operator!=(const std::string& op) const { return !(*this == op); }
+  std::string str() const { return std::string(data, size); }
+};
+
+// Descriptors are duplicated when decoded, the receiver owns them.
+struct UnixFd : public util::NonCopyable {
+  int fd;
+
+  UnixFd() : fd(-1) {}
+  explicit UnixFd(int fd) : fd(fd) {}
+  UnixFd(UnixFd&& op) : fd(op.fd) { op.fd = -1; }
+  UnixFd& operator=(UnixFd&& op) {
+    std::swap(fd, op.fd);
+    return *this;
+  }
+  ~UnixFd() {
+    if (fd >= 0) close(fd);
+  }
+  // Hands the descriptor over to the caller.
+  int Release() {
+    auto result = fd;
+    fd = -1;
+    return result;
+  }
+};
+
+template<class T>
+struct Decoder;
+
+template<class T>
+void Decode(DBusMessageIter& iter, T& value) {
+  Decoder<T>::Decode(iter, value);
+}
+
+class Variant {
+ private:
+  DBusMessageIter iter_;
+  friend struct Decoder<Variant>;
+
+ public:
+  int GetType() const {
+    auto iter = iter_;
+    return dbus_message_iter_get_arg_type(&iter);
+  }
+
+  template<class T>
+  T Get() const {
+    auto iter = iter_;
+    T result;
+    Decode(iter, result);
+    return result;
+  }
+};
+
+template<class T>
+class Array {
+ private:
+  DBusMessageIter iter_;
+  friend struct Decoder<Array<T>>;
+
+ public:
+  template<class F>
+  void ForEach(F callback) const {
+    for (auto iter = iter_; dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_INVALID; dbus_message_iter_next(&iter)) {
+      T value;
+      Decode(iter, value);
+      callback(value);
+    }
+  }
+};
+
+template<class K, class V>
+class Dict {
+ private:
+  DBusMessageIter iter_;
+  friend struct Decoder<Dict<K, V>>;
+
+ public:
+  template<class F>
+  void ForEach(F callback) const {
+    for (auto iter = iter_; dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_INVALID; dbus_message_iter_next(&iter)) {
+      CheckType(iter, DBUS_TYPE_DICT_ENTRY);
+      DBusMessageIter entry;
+      dbus_message_iter_recurse(&iter, &entry);
+      K key;
+      Decode(entry, key);
+      dbus_message_iter_next(&entry);
+      V value;
+      Decode(entry, value);
+      callback(key, value);
+    }
+  }
+};
+
+template<class T, int kType>
+struct BasicDecoder {
+  static void Decode(DBusMessageIter& iter, T& value) {
+    CheckType(iter, kType);
+    dbus_message_iter_get_basic(&iter, &value);
+  }
+};
+
+template<> struct Decoder<uint8_t> : BasicDecoder<uint8_t, DBUS_TYPE_BYTE> {};
+template<> struct Decoder<int16_t> : BasicDecoder<int16_t, DBUS_TYPE_INT16> {};
+template<> struct Decoder<uint16_t> : BasicDecoder<uint16_t, DBUS_TYPE_UINT16> {};
+template<> struct Decoder<int32_t> : BasicDecoder<int32_t, DBUS_TYPE_INT32> {};
+template<> struct Decoder<uint32_t> : BasicDecoder<uint32_t, DBUS_TYPE_UINT32> {};
+template<> struct Decoder<int64_t> : BasicDecoder<int64_t, DBUS_TYPE_INT64> {};
+template<> struct Decoder<uint64_t> : BasicDecoder<uint64_t, DBUS_TYPE_UINT64> {};
+template<> struct Decoder<double> : BasicDecoder<double, DBUS_TYPE_DOUBLE> {};
+template<> struct Decoder<UnixFd> : BasicDecoder<int, DBUS_TYPE_UNIX_FD> {
+  static void Decode(DBusMessageIter& iter, UnixFd& value) {
+    int fd;
+    BasicDecoder::Decode(iter, fd);
+    value = UnixFd(fd);
+  }
+};
+
+template<>
+struct Decoder<bool> {
+  static void Decode(DBusMessageIter& iter, bool& value) {
+    dbus_bool_t result;
+    BasicDecoder<dbus_bool_t, DBUS_TYPE_BOOLEAN>::Decode(iter, result);
+    value = result;
+  }
+};
+
+// Object paths and signatures are decoded as strings as well.
+template<>
+struct Decoder<StringView> {
+  static void Decode(DBusMessageIter& iter, StringView& value) {
+    auto type = dbus_message_iter_get_arg_type(&iter);
+    if (type != DBUS_TYPE_OBJECT_PATH && type != DBUS_TYPE_SIGNATURE) CheckType(iter, DBUS_TYPE_STRING);
+    dbus_message_iter_get_basic(&iter, &value.data);
+    value.size = std::strlen(value.data);
+  }
+};
+
+template<>
+struct Decoder<Variant> {
+  static void Decode(DBusMessageIter& iter, Variant& value) {
+    CheckType(iter, DBUS_TYPE_VARIANT);
+    dbus_message_iter_recurse(&iter, &value.iter_);
+  }
+};
+
+template<class T>
+struct Decoder<Array<T>> {
+  static void Decode(DBusMessageIter& iter, Array<T>& value) {
+    CheckType(iter, DBUS_TYPE_ARRAY);
+    dbus_message_iter_recurse(&iter, &value.iter_);
+  }
+};
+
+template<class K, class V>
+struct Decoder<Dict<K, V>> {
+  static void Decode(DBusMessageIter& iter, Dict<K, V>& value) {
+    CheckType(iter, DBUS_TYPE_ARRAY);
+    dbus_message_iter_recurse(&iter, &value.iter_);
+  }
+};
+
+// Decodes leading message arguments into values, throws if their types do not match.
+template<class... T>
+void Decode(DBusMessage* message, T&... values) {
+  ThrowIfError(message);
+  DBusMessageIter iter;
+  dbus_message_iter_init(message, &iter);
+  int unused[] = {0, (Decode(iter, values), dbus_message_iter_next(&iter), 0)...};
+  (void)unused;
+}
 
 }  // namespace dbus
 
@@ -0,0 +1,98 @@
+#include "event.h"
+#include "trace.h"
+#include <cerrno>
+#include <unistd.h>
+
+namespace {
+
+const int kMaxEvents = 16;
+
+}  // namespace
+
+namespace event {
+
+Reactor::Reactor() :
+    epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+    ready_(kMaxEvents),
+    wakeups_(0) {
+  if (epoll_fd_ < 0) util::ThrowSystemError("Failed to create epoll instance");
+  retired_.reserve(kMaxEvents);
+}
+
+Reactor::~Reactor() {
+  close(epoll_fd_);
+}
+
+void Reactor::Add(int fd, short events, Handler* handler) {
+  auto& entry = entries_[fd];
+  auto op = entry ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (!entry) entry.reset(new Entry{fd, 0, nullptr});
+  else if (entry->events == events && entry->handler == handler) return;
+  epoll_event evt = {static_cast<uint32_t>(events), {entry.get()}};
+  if (epoll_ctl(epoll_fd_, op, fd, &evt) < 0) {
+    if (op == EPOLL_CTL_ADD) entries_.erase(fd);
+    util::ThrowSystemError("Failed to register descriptor");
+  }
+  entry->events = events;
+  entry->handler = handler;
+}
+
+void Reactor::Remove(int fd) {
+  auto it = entries_.find(fd);
+  if (it == entries_.end()) return;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  // Events for this entry may still be pending in the current batch.
+  it->second->handler = nullptr;
+  retired_.push_back(std::move(it->second));
+  entries_.erase(it);
+}
+
+void Reactor::Remove(Handler* handler) {
+  std::vector<int> fds;
+  for (const auto& it : entries_) {
+    if (it.second->handler == handler)
+      fds.push_back(it.first);
+  }
+  for (auto fd : fds)
+    Remove(fd);
+}
+
+void Reactor::Wait(int timeout) {
+  auto count = epoll_wait(epoll_fd_, ready_.data(), ready_.size(), timeout);
+  if (count < 0 && errno != EINTR) util::ThrowSystemError("Polling failed");
+  if (count > 0) wakeups_.fetch_add(1, std::memory_order_relaxed);
+  if (trace::kEnabled && count > 0) trace::SetWakeup(trace::Now());
+  for (int i = 0; i < count; ++i) {
+    auto entry = static_cast<Entry*>(ready_[i].data.ptr);
+    if (!entry->handler) continue;
+    // A descriptor whose handler fails is dropped, the rest of the batch is still dispatched.
+    try {
+      entry->handler->Handle({entry->fd, entry->events, static_cast<short>(ready_[i].events)});
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+      Remove(entry->fd);
+    }
+  }
+  retired_.clear();
+}
+
+unsigned long Reactor::GetWakeups() const {
+  return wakeups_.load(std::memory_order_relaxed);
+}
+
+Source::Source(Reactor* reactor, Handler* handler) :
+    reactor_(reactor), handler_(handler) {}
+
+void Source::Watch(int fd, short events) {
+  if (reactor_) reactor_->Add(fd, events, handler_);
+}
+
+void Source::Unwatch(int fd) {
+  if (reactor_) reactor_->Remove(fd);
+}
+
+void Source::Notify() {
+  if (handler_) handler_->Handle({-1, 0, 0});
+}
+
+}  // namespace event
@@ -0,0 +1,59 @@
+#ifndef LAPS2_EVENT_H_
+#define LAPS2_EVENT_H_
+
+#include "util.h"
+#include <poll.h>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+
+namespace event {
+
+struct Handler {
+  virtual void Handle(const pollfd& fd) = 0;
+};
+
+class Reactor : public util::NonCopyable {
+ private:
+  struct Entry {
+    int fd;
+    short events;
+    Handler* handler;
+  };
+
+  int epoll_fd_;
+  std::unordered_map<int, std::unique_ptr<Entry>> entries_;
+  std::vector<std::unique_ptr<Entry>> retired_;
+  std::vector<epoll_event> ready_;
+  std::atomic<unsigned long> wakeups_;
+
+ public:
+  Reactor();
+  ~Reactor();
+  void Add(int fd, short events, Handler* handler);
+  void Remove(int fd);
+  void Remove(Handler* handler);
+  void Wait(int timeout);
+  // Waits that returned ready descriptors, may be read from other threads.
+  unsigned long GetWakeups() const;
+};
+
+// Registers descriptors on behalf of a single handler, so helpers can watch them for their owner.
+class Source {
+ private:
+  Reactor* reactor_;
+  Handler* handler_;
+
+ public:
+  Source(Reactor* reactor = nullptr, Handler* handler = nullptr);
+  void Watch(int fd, short events);
+  void Unwatch(int fd);
+  // Runs the handler for updates that arrived through descriptors it does not own, fd is -1 then.
+  void Notify();
+};
+
+}  // namespace event
+
+#endif  // LAPS2_EVENT_H_
@@ -0,0 +1,158 @@
+#include "history.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define LAPS2_HISTORY_SSE2
+#endif
+
+namespace {
+
+// Blocks read per column at most twice this, enough to fill a vector register.
+const size_t kBlocksPerColumn = 16;
+
+// Folds count block minima and maxima into lo and hi.
+void MinMax(const uint8_t* min, const uint8_t* max, size_t count, uint8_t& lo, uint8_t& hi) {
+  size_t i = 0;
+#ifdef LAPS2_HISTORY_SSE2
+  if (count >= 16) {
+    auto vlo = _mm_set1_epi8(static_cast<char>(lo));
+    auto vhi = _mm_set1_epi8(static_cast<char>(hi));
+    for (; i + 16 <= count; i += 16) {
+      vlo = _mm_min_epu8(vlo, _mm_loadu_si128(reinterpret_cast<const __m128i*>(min + i)));
+      vhi = _mm_max_epu8(vhi, _mm_loadu_si128(reinterpret_cast<const __m128i*>(max + i)));
+    }
+    // Halves are folded onto each other until the first byte holds the result.
+    vlo = _mm_min_epu8(vlo, _mm_srli_si128(vlo, 8));
+    vlo = _mm_min_epu8(vlo, _mm_srli_si128(vlo, 4));
+    vlo = _mm_min_epu8(vlo, _mm_srli_si128(vlo, 2));
+    vlo = _mm_min_epu8(vlo, _mm_srli_si128(vlo, 1));
+    vhi = _mm_max_epu8(vhi, _mm_srli_si128(vhi, 8));
+    vhi = _mm_max_epu8(vhi, _mm_srli_si128(vhi, 4));
+    vhi = _mm_max_epu8(vhi, _mm_srli_si128(vhi, 2));
+    vhi = _mm_max_epu8(vhi, _mm_srli_si128(vhi, 1));
+    lo = static_cast<uint8_t>(_mm_cvtsi128_si32(vlo));
+    hi = static_cast<uint8_t>(_mm_cvtsi128_si32(vhi));
+  }
+#endif
+  for (; i < count; ++i) {
+    lo = std::min(lo, min[i]);
+    hi = std::max(hi, max[i]);
+  }
+}
+
+}  // namespace
+
+namespace history {
+
+Ring::Ring(size_t capacity) :
+    capacity_(1), count_(0) {
+  while (capacity_ < capacity)
+    capacity_ <<= 1;
+  size_t size = 0;
+  for (auto blocks = capacity_; blocks; blocks >>= 1) {
+    offsets_.push_back(size);
+    size += blocks;
+  }
+  min_.resize(size);
+  max_.resize(size);
+}
+
+// Every level updates the block the sample falls into, the first sample of a block replaces it.
+void Ring::Push(uint8_t level) {
+  auto index = count_++;
+  for (size_t k = 0; k < offsets_.size(); ++k) {
+    auto slot = offsets_[k] + ((index >> k) & ((capacity_ >> k) - 1));
+    if (index & ((1ull << k) - 1)) {
+      min_[slot] = std::min(min_[slot], level);
+      max_[slot] = std::max(max_[slot], level);
+    } else {
+      min_[slot] = max_[slot] = level;
+    }
+  }
+}
+
+size_t Ring::GetCapacity() const {
+  return capacity_;
+}
+
+uint64_t Ring::GetCount() const {
+  return count_;
+}
+
+// Uses the coarsest level that still has kBlocksPerColumn blocks per column. The window ends with
+// the block of the latest sample, which may be partially filled, and may reach a few samples
+// further back than capacity.
+void Ring::Reduce(size_t columns, uint8_t* min, uint8_t* max) const {
+  if (!columns) return;
+  size_t k = 0;
+  while (k + 1 < offsets_.size() && (capacity_ >> (k + 1)) >= columns * kBlocksPerColumn)
+    ++k;
+  auto blocks = capacity_ >> k;
+  auto lo_base = min_.data() + offsets_[k];
+  auto hi_base = max_.data() + offsets_[k];
+  auto end = static_cast<int64_t>(count_ ? ((count_ - 1) >> k) + 1 : 0);
+  auto first = end - static_cast<int64_t>(blocks);
+  for (size_t c = 0; c < columns; ++c) {
+    auto begin = first + static_cast<int64_t>(c * blocks / columns);
+    auto last = std::max(first + static_cast<int64_t>((c + 1) * blocks / columns), begin + 1);
+    uint8_t lo = 0xff;
+    uint8_t hi = 0;
+    // Blocks before the first sample were never written.
+    for (begin = std::max<int64_t>(begin, 0); begin < last;) {
+      auto start = static_cast<size_t>(begin) & (blocks - 1);
+      auto run = std::min(static_cast<size_t>(last - begin), blocks - start);
+      MinMax(lo_base + start, hi_base + start, run, lo, hi);
+      begin += run;
+    }
+    min[c] = lo;
+    max[c] = hi;
+  }
+}
+
+Sparkline::Sparkline() :
+    polygon_({nullptr, 0}),
+    pointer_(&polygon_),
+    icon_({&pointer_, 1, 0, nullptr}) {}
+
+// Points run left to right along the max of every column and back along the min, through the
+// column centers. Icon coordinates resolve 256 columns at most.
+const Icon* Sparkline::Build(const Ring& ring, int width, int height) {
+  if (width <= 0 || height <= 0 || !ring.GetCount()) return nullptr;
+  auto columns = static_cast<size_t>(std::min(width, 256));
+  min_.resize(columns);
+  max_.resize(columns);
+  ring.Reduce(columns, min_.data(), max_.data());
+  // The last column holds the latest sample, so at least one is not empty.
+  size_t first = 0;
+  while (min_[first] > max_[first])
+    ++first;
+  auto thickness = std::min((256 + height - 1) / height, 255);
+  for (auto c = first; c < columns; ++c) {
+    auto top = 255 - max_[c];
+    auto bottom = 255 - min_[c];
+    if (bottom - top < thickness) {
+      bottom = std::min(top + thickness, 255);
+      top = bottom - thickness;
+    }
+    max_[c] = static_cast<uint8_t>(top);
+    min_[c] = static_cast<uint8_t>(bottom);
+  }
+  auto left = static_cast<uint8_t>(first * 256 / columns);
+  auto center = [columns](size_t c) {
+    return static_cast<uint8_t>((c * 2 + 1) * 128 / columns);
+  };
+  points_.clear();
+  points_.insert(points_.end(), {left, max_[first]});
+  for (auto c = first; c < columns; ++c)
+    points_.insert(points_.end(), {center(c), max_[c]});
+  points_.insert(points_.end(), {255, max_[columns - 1], 255, min_[columns - 1]});
+  for (auto c = columns; c-- > first;)
+    points_.insert(points_.end(), {center(c), min_[c]});
+  points_.insert(points_.end(), {left, min_[first]});
+  polygon_ = {points_.data(), points_.size() / 2};
+  icon_.max_points = polygon_.count;
+  return &icon_;
+}
+
+}  // namespace history
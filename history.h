@@ -0,0 +1,55 @@
+#ifndef LAPS2_HISTORY_H_
+#define LAPS2_HISTORY_H_
+
+#include "icon.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace history {
+
+// Fixed number of the latest samples as levels, the oldest is overwritten first. Besides the samples,
+// min and max of aligned blocks are kept for every power of two block size, so downsampling to a
+// width reads a bounded number of bytes per column however many samples are kept.
+class Ring {
+ private:
+  size_t capacity_;
+  uint64_t count_;
+  // Level k of the block pyramid starts at offsets_[k] and holds capacity >> k blocks.
+  std::vector<size_t> offsets_;
+  std::vector<uint8_t> min_;
+  std::vector<uint8_t> max_;
+
+ public:
+  // Capacity is rounded up to a power of two.
+  Ring(size_t capacity);
+  void Push(uint8_t level);
+  size_t GetCapacity() const;
+  // Samples pushed so far, changes with every push.
+  uint64_t GetCount() const;
+  // Min and max of the window of the latest capacity samples spread over columns, oldest first.
+  // Columns before the first sample are empty, with min above max.
+  void Reduce(size_t columns, uint8_t* min, uint8_t* max) const;
+};
+
+// Polygon along the min and max of every column, at least a pixel thick, so a history is drawn
+// like any fixed icon. Buffers are reused between builds.
+class Sparkline {
+ private:
+  std::vector<uint8_t> min_;
+  std::vector<uint8_t> max_;
+  std::vector<uint8_t> points_;
+  IconPolygon polygon_;
+  const IconPolygon* pointer_;
+  Icon icon_;
+
+ public:
+  Sparkline();
+  Sparkline(const Sparkline&) = delete;
+  // Returns nullptr while the history is empty, the result is valid until the next build.
+  const Icon* Build(const Ring& ring, int width, int height);
+};
+
+}  // namespace history
+
+#endif  // LAPS2_HISTORY_H_
@@ -0,0 +1,168 @@
+#include "icon.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace {
+
+// Pixels the fill grows by from level 0 to 255.
+int Span(const IconFill& fill, int width, int height) {
+  auto size = fill.axis == IconFill::kX ? width : height;
+  return std::max(1, std::abs(fill.to - fill.from) * size / 256);
+}
+
+// Single plane Sutherland-Hodgman, keeps the part of the polygon on the from side of the edge.
+void Clip(const IconPolygon& polygon, const IconFill& fill, int edge, std::vector<uint8_t>& result) {
+  auto axis = fill.axis == IconFill::kX ? 0 : 1;
+  auto sign = fill.to > fill.from ? 1 : -1;
+  auto end = polygon.points + polygon.count * 2;
+  auto prev = end - 2;
+  for (auto ptr = polygon.points; ptr != end; prev = ptr, ptr += 2) {
+    auto prev_inside = (prev[axis] - edge) * sign <= 0;
+    auto inside = (ptr[axis] - edge) * sign <= 0;
+    if (inside != prev_inside) {
+      uint8_t point[2];
+      auto t = static_cast<float>(edge - prev[axis]) / (ptr[axis] - prev[axis]);
+      point[axis] = static_cast<uint8_t>(edge);
+      point[1 - axis] = static_cast<uint8_t>(std::lround(prev[1 - axis] + t * (ptr[1 - axis] - prev[1 - axis])));
+      result.insert(result.end(), point, point + 2);
+    }
+    if (inside) result.insert(result.end(), ptr, ptr + 2);
+  }
+}
+
+std::vector<const Icon*>& GetRegistry() {
+  static std::vector<const Icon*> registry;
+  return registry;
+}
+
+}  // namespace
+
+bool IconState::operator==(const IconState& op) const {
+  return icon == op.icon && level == op.level;
+}
+
+bool IconState::operator!=(const IconState& op) const {
+  return !(*this == op);
+}
+
+namespace icon {
+
+std::vector<std::vector<uint8_t>> Parse(const std::string& source) {
+  if (source.size() % 2) throw std::runtime_error("Odd number of coordinates");
+  std::vector<std::vector<uint8_t>> result;
+  std::vector<uint8_t> polygon;
+  for (size_t i = 0; i < source.size(); i += 2) {
+    auto x = static_cast<uint8_t>(source[i]);
+    auto y = static_cast<uint8_t>(source[i + 1]);
+    if (x || y) {
+      polygon.push_back(x);
+      polygon.push_back(y);
+      continue;
+    }
+    // An empty polygon terminates the icon.
+    if (polygon.empty()) {
+      if (i + 2 != source.size()) throw std::runtime_error("Data after the end of icon");
+      if (result.empty()) throw std::runtime_error("Icon has no polygons");
+      return result;
+    }
+    if (polygon.size() < 6)
+      throw std::runtime_error("Polygon " + std::to_string(result.size()) + " has less than 3 points");
+    result.push_back(std::move(polygon));
+    polygon.clear();
+  }
+  throw std::runtime_error("Icon is not terminated");
+}
+
+Holder::Holder(const std::string& source) :
+    points_(Parse(source)),
+    icon_({nullptr, points_.size(), 0, nullptr}) {
+  for (const auto& it : points_) {
+    polygons_.push_back({it.data(), it.size() / 2});
+    icon_.max_points = std::max(icon_.max_points, it.size() / 2);
+  }
+  for (const auto& it : polygons_)
+    pointers_.push_back(&it);
+  icon_.polygons = pointers_.data();
+}
+
+const Icon* Holder::Get() const {
+  return &icon_;
+}
+
+Registration::Registration(std::initializer_list<const Icon*> icons) {
+  GetRegistry().insert(GetRegistry().end(), icons);
+}
+
+uint32_t GetId(const Icon* icon) {
+  if (!icon) return 0;
+  const auto& registry = GetRegistry();
+  auto it = std::find(registry.begin(), registry.end(), icon);
+  if (it == registry.end()) throw std::runtime_error("Icon is not registered");
+  return static_cast<uint32_t>(it - registry.begin() + 1);
+}
+
+const Icon* Find(uint32_t id) {
+  const auto& registry = GetRegistry();
+  return id && id <= registry.size() ? registry[id - 1] : nullptr;
+}
+
+uint8_t Level(long value, long min, long max) {
+  if (max <= min) return 0;
+  return static_cast<uint8_t>(std::min(std::max(value - min, 0L), max - min) * 255 / (max - min));
+}
+
+int Bucket(const IconState& state, int width, int height) {
+  if (!state.icon || !state.icon->fill) return 0;
+  return (state.level * Span(*state.icon->fill, width, height) + 127) / 255;
+}
+
+Instance::Instance() :
+    icon_({nullptr, 0, 0, nullptr}) {}
+
+std::vector<uint8_t>& Instance::Use(size_t index) {
+  if (points_.size() <= index) points_.resize(index + 1);
+  points_[index].clear();
+  return points_[index];
+}
+
+const Icon* Instance::Build(const IconState& state, int width, int height) {
+  if (!state.icon->fill) return state.icon;
+  const auto& fill = *state.icon->fill;
+  auto edge = fill.from + (fill.to - fill.from) * Bucket(state, width, height) / Span(fill, width, height);
+  size_t used = 0;
+  for (size_t i = 0; i < fill.shape->count; ++i) {
+    auto& points = Use(used);
+    Clip(*fill.shape->polygons[i], fill, edge, points);
+    if (points.size() >= 6) ++used;
+  }
+  for (size_t i = 0; fill.cutout && i < fill.cutout->count; ++i) {
+    const auto& polygon = *fill.cutout->polygons[i];
+    if (!used) {
+      Use(used++).assign(polygon.points, polygon.points + polygon.count * 2);
+      continue;
+    }
+    // Bridges to the cutout and back run along the same line in opposite directions and cancel.
+    auto& points = points_[0];
+    uint8_t start[] = {points[0], points[1]};
+    points.insert(points.end(), start, start + 2);
+    points.insert(points.end(), polygon.points, polygon.points + polygon.count * 2);
+    points.insert(points.end(), polygon.points, polygon.points + 2);
+    points.insert(points.end(), start, start + 2);
+  }
+  polygons_.clear();
+  pointers_.assign(state.icon->polygons, state.icon->polygons + state.icon->count);
+  icon_.max_points = state.icon->max_points;
+  for (size_t i = 0; i < used; ++i) {
+    polygons_.push_back({points_[i].data(), points_[i].size() / 2});
+    icon_.max_points = std::max(icon_.max_points, points_[i].size() / 2);
+  }
+  for (const auto& it : polygons_)
+    pointers_.push_back(&it);
+  icon_.polygons = pointers_.data();
+  icon_.count = pointers_.size();
+  return &icon_;
+}
+
+}  // namespace icon
@@ -0,0 +1,108 @@
+#ifndef LAPS2_ICON_H_
+#define LAPS2_ICON_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+// Closed outline of count points, stored as x y pairs scaled to 0..255. Polygons are filled with
+// the even-odd rule, and shared between all icons drawing the same outline.
+struct IconPolygon {
+  const uint8_t* points;
+  size_t count;
+};
+
+struct IconFill;
+
+// Icons are generated by the resource compiler, which validated every polygon already.
+struct Icon {
+  const IconPolygon* const* polygons;
+  size_t count;
+  // Longest polygon, so renderers can size their buffers up front.
+  size_t max_points;
+  // Only set for parametric icons, drawn on top of the polygons above.
+  const IconFill* fill;
+};
+
+// Region of a parametric icon that grows with the level. Its polygons are clipped at an edge
+// moving along the axis, from one coordinate at level 0 to the other at level 255.
+struct IconFill {
+  enum Axis {
+    kX = 0,
+    kY
+  };
+
+  const Icon* shape;
+  // Merged into the clipped fill even-odd, so it shows inverted where the fill covers it.
+  const Icon* cutout;
+  Axis axis;
+  uint8_t from;
+  uint8_t to;
+};
+
+// What a widget shows, the level only matters to parametric icons.
+struct IconState {
+  const Icon* icon;
+  uint8_t level;
+  bool operator==(const IconState& op) const;
+  bool operator!=(const IconState& op) const;
+};
+
+namespace icon {
+
+// Splits the zero pair terminated source format into polygons, throws if it is malformed.
+std::vector<std::vector<uint8_t>> Parse(const std::string& source);
+
+// Owns the polygons of an icon parsed at runtime.
+class Holder {
+ private:
+  std::vector<std::vector<uint8_t>> points_;
+  std::vector<IconPolygon> polygons_;
+  std::vector<const IconPolygon*> pointers_;
+  Icon icon_;
+
+ public:
+  Holder(const std::string& source);
+  Holder(const Holder&) = delete;
+  const Icon* Get() const;
+};
+
+// Icons widgets show, numbered from 1 in the order they register during static initialization.
+// Processes running the same build agree on the numbers, so states can be passed between them.
+struct Registration {
+  Registration(std::initializer_list<const Icon*> icons);
+};
+
+// Ids are 0 for no icon, throws for icons never registered.
+uint32_t GetId(const Icon* icon);
+// Returns nullptr for unknown ids.
+const Icon* Find(uint32_t id);
+
+// Maps value within min and max to a level, clamped.
+uint8_t Level(long value, long min, long max);
+
+// Level quantized to whole pixels the fill covers at the given size, always 0 for fixed icons.
+int Bucket(const IconState& state, int width, int height);
+
+// Polygons of an icon at a level, buffers are reused between builds.
+class Instance {
+ private:
+  std::vector<std::vector<uint8_t>> points_;
+  std::vector<IconPolygon> polygons_;
+  std::vector<const IconPolygon*> pointers_;
+  Icon icon_;
+
+  std::vector<uint8_t>& Use(size_t index);
+
+ public:
+  Instance();
+  Instance(const Instance&) = delete;
+  // Fixed icons are returned as they are, the result is valid until the next build.
+  const Icon* Build(const IconState& state, int width, int height);
+};
+
+}  // namespace icon
+
+#endif  // LAPS2_ICON_H_
@@ -1,154 +1,931 @@
+#include "dbus.h"
+#include "pixmap.h"
+#include "replay.h"
+#include "sample.h"
+#include "screen.h"
+#include "shared.h"
+#include "trace.h"
+#include "view.h"
 #include "widget.h"
+#include "worker.h"
 #include "xcb.h"
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <system_error>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 namespace {
 
-class WidgetView {
+// Minimum time between two repaints in milliseconds, overridden by LAPS2_FRAME_INTERVAL.
+const int kDefaultFrameInterval = 50;
+
+// Time given to widget backends to initialize in milliseconds, overridden by LAPS2_INIT_TIMEOUT.
+const int kDefaultInitTimeout = 5000;
+
+// Enough to hold every icon at one size.
+const size_t kPixmapCacheSize = 32;
+
+// Size of the views drawn without a display.
+const int kHeadlessSize = 24;
+
+// Collects damaged views and repaints them together, at most once per interval.
+class FrameScheduler : public event::Handler {
+ public:
+  struct Stats {
+    unsigned long frames;
+    unsigned long repairs;
+    unsigned long coalesced;
+    unsigned long unchanged;
+    unsigned long deferred;
+  };
+
  private:
-  int width_;
-  int height_;
-  const uint8_t* state_;
-  xcb_window_t window_;
-  xcb_gcontext_t context_;
-
-  static xcb_window_t CreateWindow(xcb_connection_t* conn, int width, int height) {
-    auto result = xcb_generate_id(conn);
-    auto screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
-    uint32_t mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
-    uint32_t values[] = {screen->white_pixel, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_RESIZE_REDIRECT};
-    xcb_create_window(conn, XCB_COPY_FROM_PARENT, result, screen->root, 0, 0, width, height, 0,
-                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, mask, values);
-    return result;
-  }
-
-  static xcb_gcontext_t CreateContext(xcb_connection_t* conn) {
-    auto result = xcb_generate_id(conn);
-    auto screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
-    uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
-    uint32_t values[] = {screen->black_pixel, 0};
-    xcb_create_gc(conn, result, screen->root, mask, values);
-    return result;
+  xcb_connection_t* conn_;
+  int fd_;
+  uint64_t interval_;
+  uint64_t next_frame_;
+  bool armed_;
+  std::vector<WidgetView*> dirty_;
+  Stats stats_;
+
+  static uint64_t Now() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+  }
+
+  void Arm() {
+    if (armed_) return;
+    auto deadline = std::max(Now(), next_frame_);
+    itimerspec spec = {{0, 0}, {static_cast<time_t>(deadline / 1000000000), static_cast<long>(deadline % 1000000000)}};
+    if (timerfd_settime(fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+      util::ThrowSystemError("Failed to arm frame timer");
+    armed_ = true;
   }
 
  public:
-  WidgetView(const WidgetView&) = delete;
-  WidgetView(WidgetView&&) = default;
+  FrameScheduler(xcb_connection_t* conn, int interval_ms) :
+      conn_(conn),
+      fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      interval_(interval_ms * 1000000ull),
+      next_frame_(0),
+      armed_(false),
+      stats_({0, 0, 0, 0, 0}) {
+    if (fd_ < 0) util::ThrowSystemError("Failed to create frame timer");
+  }
 
-  WidgetView(xcb_connection_t* conn, int screen_number) :
-      width_(-1), height_(-1),
-      state_(nullptr),
-      window_(CreateWindow(conn, width_, height_)),
-      context_(CreateContext(conn)) {
-    auto tray = xcb::FindTray(conn, screen_number);
-    xcb::Embed(conn, tray, window_);
+  ~FrameScheduler() {
+    close(fd_);
   }
 
-  void Update(xcb_connection_t* conn) {
-    if (width_ < 0 || height_ < 0 || !state_) return;
-    xcb_clear_area(conn, false, window_, 0, 0, width_, height_);
-    xcb_flush(conn);
-    for (auto ptr = state_; ptr[0] || ptr[1]; ptr += 2) {
-      std::vector<xcb_point_t> poly;
-      for (; ptr[0] || ptr[1]; ptr += 2)
-        poly.push_back({static_cast<int16_t>(width_ * ptr[0] >> 8), static_cast<int16_t>(height_ * ptr[1] >> 8)});
-      xcb_fill_poly(conn, window_, context_, XCB_POLY_SHAPE_NONCONVEX, XCB_COORD_MODE_ORIGIN, poly.size(), poly.data());
+  int GetFd() const {
+    return fd_;
+  }
+
+  // Hidden views only keep their latest state, nothing wakes up to draw it.
+  void Invalidate(WidgetView* view, const xcb_rectangle_t& area) {
+    if (!view->IsVisible()) {
+      ++stats_.deferred;
+      return;
+    }
+    if (!view->Damage(area)) {
+      ++stats_.coalesced;
+      return;
     }
+    dirty_.push_back(view);
+    Arm();
   }
 
-  void Resize(int width, int height) {
-    width_ = width;
-    height_ = height;
+  // Has to be called before a view is destroyed, its pending repair is dropped.
+  void Forget(WidgetView* view) {
+    dirty_.erase(std::remove(dirty_.begin(), dirty_.end(), view), dirty_.end());
   }
 
-  void SetState(const uint8_t* state) {
-    state_ = state;
+  void Resize(WidgetView* view, int width, int height) {
+    if (view->Resize(width, height))
+      Invalidate(view, view->GetArea());
   }
 
-  bool operator==(xcb_window_t op) const {
-    return window_ == op;
+  // Views shown again are repainted as a whole, with the latest state.
+  bool Hide(WidgetView* view, WidgetView::Hidden reason, bool hidden) {
+    if (!view->Hide(reason, hidden)) return false;
+    if (view->IsVisible()) Invalidate(view, view->GetArea());
+    return true;
+  }
+
+  void SetState(WidgetView* view, const IconState& state, int64_t origin = 0) {
+    if (view->SetState(state, origin)) Invalidate(view, view->GetArea());
+    else ++stats_.unchanged;
+  }
+
+  void Handle(const pollfd&) override {
+    uint64_t expirations;
+    if (read(fd_, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    for (auto it : dirty_)
+      it->Repair();
+    stats_.repairs += dirty_.size();
+    ++stats_.frames;
+    {
+      trace::Span span("frame", trace::kFlush);
+      xcb_flush(conn_);
+    }
+    if (trace::kEnabled) {
+      auto now = trace::Now();
+      for (auto it : dirty_)
+        it->Present(now);
+    }
+    dirty_.clear();
+    next_frame_ = Now() + interval_;
+    armed_ = false;
+  }
+
+  const Stats& GetStats() const {
+    return stats_;
   }
 };
 
-using WidgetsBinding = std::list<std::pair<Widget*, WidgetView>>;
+class Startup;
+
+struct WidgetBinding : public event::Handler {
+  using Clock = std::chrono::steady_clock;
 
-void HandleXcbEvent(xcb_connection_t* conn, xcb_generic_event_t* evt, WidgetsBinding& widgets) {
-  static const auto find_widget = [](auto& widgets, auto window) {
-    return std::find_if(widgets.begin(), widgets.end(), [window](const auto& op){return op.second == window;});
+  enum Status {
+    kPending = 0,
+    kReady,
+    kFailed,
+    kTimedOut
   };
 
-  switch (evt->response_type & ~0x80) {
-    case XCB_EXPOSE: {
-      auto req = reinterpret_cast<xcb_expose_event_t*>(evt);
-      auto it = find_widget(widgets, req->window);
-      if (it != widgets.end()) it->second.Update(conn);
-      break;
-    }
-    case XCB_RESIZE_REQUEST: {
-      auto req = reinterpret_cast<xcb_resize_request_event_t*>(evt);
-      auto it = find_widget(widgets, req->window);
-      if (it != widgets.end()) {
-        it->second.Resize(req->width, req->height);
-        it->second.Update(conn);
+  FrameScheduler& scheduler;
+  Startup& startup;
+  Widget* widget;
+  bool bound;
+  std::unique_ptr<Worker> worker;
+  std::future<void> started;
+  std::unique_ptr<WidgetView> view;
+  // Set for widgets mirrored from a collector, their backends do not run in this process.
+  shared::Subscriber* subscriber;
+  size_t slot;
+  Status status;
+  Clock::time_point begin;
+  Clock::time_point initialized;
+  Clock::time_point embedded;
+
+  WidgetBinding(FrameScheduler& scheduler, Startup& startup, Widget* widget) :
+      scheduler(scheduler), startup(startup), widget(widget), bound(false), subscriber(nullptr), slot(0),
+      status(kPending) {}
+
+  ~WidgetBinding() {
+    if (bound) widget->Bind(nullptr, nullptr);
+  }
+
+  IconState GetState() {
+    if (subscriber) return subscriber->Read(slot);
+    if (worker) return worker->Read();
+    trace::Span span(widget->GetName(), trace::kGetState);
+    return widget->GetState();
+  }
+
+  void Handle(const pollfd& fd) override;
+};
+
+using WidgetsBinding = std::list<WidgetBinding>;
+
+// Slots moved or changed size, every view of the compositor is repainted.
+void Relayout(Compositor& compositor, FrameScheduler& scheduler) {
+  auto size = compositor.GetSlotSize();
+  compositor.ForEach([&scheduler, size](WidgetView* view) {
+    scheduler.Resize(view, size, size);
+    scheduler.Invalidate(view, view->GetArea());
+  });
+}
+
+// The shared bus and sampling scheduler are static, detach them before the reactor goes away.
+struct ReactorScope {
+  ReactorScope(event::Reactor& reactor) {
+    dbus::Bus::Get().Bind(&reactor);
+    sample::Scheduler::Get().Bind(&reactor);
+  }
+
+  ~ReactorScope() {
+    sample::Scheduler::Get().Bind(nullptr);
+    dbus::Bus::Get().Bind(nullptr);
+  }
+};
+
+// Initializes widgets concurrently, each icon is embedded as soon as its backend is ready.
+// Backends still initializing when the timeout expires are abandoned.
+class Startup : public event::Handler {
+ private:
+  using Clock = WidgetBinding::Clock;
+
+  xcb_connection_t* conn_;
+  event::Reactor& reactor_;
+  PixmapCache& cache_;
+  Compositor* compositor_;
+  bool trends_;
+  xcb::Atoms& atoms_;
+  xcb_window_t tray_;
+  WidgetsBinding& widgets_;
+  Clock::time_point begin_;
+  int fd_;
+
+  void Fail(WidgetBinding& binding, const std::exception& ex) {
+    util::PrintException(ex);
+    binding.status = WidgetBinding::kFailed;
+    binding.embedded = Clock::now();
+    reactor_.Remove(&binding);
+    sample::Scheduler::Get().Remove(binding.widget);
+    if (binding.bound) binding.widget->Bind(nullptr, nullptr);
+    binding.bound = false;
+    binding.worker.reset();
+    if (compositor_ && binding.view) {
+      compositor_->Remove(binding.view.get());
+      Relayout(*compositor_, binding.scheduler);
+    }
+    if (binding.view) binding.scheduler.Forget(binding.view.get());
+    binding.view.reset();
+  }
+
+  void Embed(WidgetBinding& binding) {
+    binding.initialized = Clock::now();
+    try {
+      if (compositor_) {
+        // The shared window is embedded with the first view, later ones only take a slot.
+        binding.view = compositor_->Add(binding.widget->GetName());
+        if (compositor_->GetCount() == 1) xcb::Embed(conn_, atoms_, tray_, compositor_->GetWindow());
+        Relayout(*compositor_, binding.scheduler);
+      } else {
+        binding.view = std::make_unique<WidgetView>(binding.widget->GetName(),
+                                                    std::make_unique<PixmapSurface>(conn_, cache_, 1, 1));
+        xcb::Embed(conn_, atoms_, tray_, binding.view->GetSurface().GetWindow());
+      }
+      // Histories of threaded widgets would be read while they are written, mirrored ones have none here.
+      if (trends_ && !binding.worker && !binding.subscriber) binding.view->SetHistory(binding.widget->GetHistory());
+      binding.view->SetState(binding.GetState());
+      xcb_flush(conn_);
+    } catch (const std::exception& ex) {
+      Fail(binding, ex);
+      return;
+    }
+    binding.status = WidgetBinding::kReady;
+    binding.embedded = Clock::now();
+  }
+
+ public:
+  Startup(xcb_connection_t* conn, event::Reactor& reactor, PixmapCache& cache, Compositor* compositor, bool trends,
+          xcb::Atoms& atoms, xcb_window_t tray, WidgetsBinding& widgets, int timeout) :
+      conn_(conn), reactor_(reactor), cache_(cache), compositor_(compositor), trends_(trends), atoms_(atoms),
+      tray_(tray),
+      widgets_(widgets),
+      begin_(Clock::now()), fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+    if (fd_ < 0) util::ThrowSystemError("Failed to create startup timerfd");
+    itimerspec spec = {{0, 0}, {timeout / 1000, timeout % 1000 * 1000000}};
+    if (timerfd_settime(fd_, 0, &spec, nullptr) < 0) {
+      close(fd_);
+      util::ThrowSystemError("Failed to arm startup timer");
+    }
+  }
+
+  ~Startup() {
+    close(fd_);
+  }
+
+  int GetFd() const {
+    return fd_;
+  }
+
+  // Widgets on the main thread are initialized synchronously, workers complete from the reactor.
+  void Start(WidgetBinding& binding, int argc, char** argv, bool threaded) {
+    binding.begin = Clock::now();
+    try {
+      if (threaded && binding.widget->MayBlock()) {
+        binding.worker = std::make_unique<Worker>(binding.widget);
+        binding.started = binding.worker->Start(argc, argv);
+        reactor_.Add(binding.worker->GetFd(), POLLIN, &binding);
+        return;
+      }
+      binding.bound = true;
+      binding.widget->Bind(&reactor_, &binding);
+      binding.widget->Init(argc, argv);
+    } catch (const std::exception& ex) {
+      Fail(binding, ex);
+      return;
+    }
+    Embed(binding);
+  }
+
+  // Backends of mirrored widgets were initialized by the collector already.
+  void Mirror(WidgetBinding& binding) {
+    binding.begin = Clock::now();
+    Embed(binding);
+  }
+
+  void Complete(WidgetBinding& binding) {
+    if (!binding.started.valid()) return;
+    if (binding.started.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+    try {
+      binding.started.get();
+    } catch (const std::exception&) {
+      try {
+        std::throw_with_nested(std::runtime_error(std::string("Failed to initialize ") + binding.widget->GetName()));
+      } catch (const std::exception& ex) {
+        Fail(binding, ex);
       }
-      break;
+      return;
     }
-    default:
-      break;
+    Embed(binding);
   }
+
+  void Handle(const pollfd&) override {
+    uint64_t expirations;
+    if (read(fd_, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    for (auto& it : widgets_) {
+      if (it.status != WidgetBinding::kPending) continue;
+      std::cerr << "Widget " << it.widget->GetName() << " did not initialize in time" << std::endl;
+      it.status = WidgetBinding::kTimedOut;
+      reactor_.Remove(&it);
+      it.worker->Abandon();
+    }
+  }
+
+  void Report(std::ostream& out) const {
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    const char* kStatus[] = {"pending", "ready", "failed", "timed out"};
+    out << std::fixed << std::setprecision(1);
+    for (const auto& it : widgets_) {
+      out << "startup: " << it.widget->GetName() << " " << kStatus[it.status];
+      if (it.status == WidgetBinding::kReady) {
+        out << ", init " << Milliseconds(it.initialized - it.begin).count() << " ms"
+            << ", embed " << Milliseconds(it.embedded - it.initialized).count() << " ms"
+            << ", visible at " << Milliseconds(it.embedded - begin_).count() << " ms";
+      } else if (it.status == WidgetBinding::kFailed) {
+        out << " at " << Milliseconds(it.embedded - begin_).count() << " ms";
+      }
+      out << std::endl;
+    }
+    out.unsetf(std::ios::floatfield);
+  }
+};
+
+// Threaded widgets only signal published states here, their descriptors are watched by the worker.
+void WidgetBinding::Handle(const pollfd& fd) {
+  if (!view) {
+    startup.Complete(*this);
+    return;
+  }
+  if (!worker) {
+    trace::Span span(widget->GetName(), trace::kHandle);
+    widget->Handle(fd);
+  }
+  auto state = GetState();
+  if (!trace::kEnabled) scheduler.SetState(view.get(), state);
+  else scheduler.SetState(view.get(), state, worker ? worker->GetOrigin() : trace::GetWakeup());
 }
 
-void HandleWidgetEvent(xcb_connection_t* conn, const pollfd& fd, WidgetsBinding& widgets) {
-  static const auto& find_widget = [](auto& widgets, const auto& fd) {
-    return std::find_if(widgets.begin(), widgets.end(), [fd](const auto& op) {
-      const auto& fds = op.first->GetPollFds();
-      return std::find(fds.begin(), fds.end(), fd) != fds.end();
-    });
+// Drains the whole X event queue, damage is merged per view by the frame scheduler.
+class XcbHandler : public event::Handler {
+ public:
+  struct Stats {
+    unsigned long batches;
+    unsigned long events;
   };
 
-  auto it = find_widget(widgets, fd);
-  if (it != widgets.end()) {
-    it->first->Handle(fd);
-    it->second.SetState(it->first->GetState());
-    it->second.Update(conn);
+ private:
+  xcb_connection_t* conn_;
+  FrameScheduler& scheduler_;
+  PixmapCache& cache_;
+  Compositor* compositor_;
+  ScreenMonitor& screen_;
+  WidgetsBinding& widgets_;
+  Stats stats_;
+
+  // Events of the shared window are routed to the views by slot.
+  void HandleComposite(xcb_generic_event_t* evt) {
+    switch (evt->response_type & ~0x80) {
+      case XCB_EXPOSE: {
+        auto req = reinterpret_cast<xcb_expose_event_t*>(evt);
+        compositor_->Expose({static_cast<int16_t>(req->x), static_cast<int16_t>(req->y), req->width, req->height},
+                            [this](WidgetView* view, const xcb_rectangle_t& area) {
+          scheduler_.Invalidate(view, area);
+        });
+        break;
+      }
+      case XCB_RESIZE_REQUEST: {
+        auto req = reinterpret_cast<xcb_resize_request_event_t*>(evt);
+        if (compositor_->Resize(req->width, req->height)) Relayout(*compositor_, scheduler_);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  WidgetView* FindView(xcb_window_t window) {
+    auto it = std::find_if(widgets_.begin(), widgets_.end(), [window](const auto& op) {
+      return op.view && *op.view == window;
+    });
+    return it == widgets_.end() ? nullptr : it->view.get();
+  }
+
+  // Widgets whose icon can not be seen are not sampled, and their backend is told so. Those on the
+  // main thread are asked for their state once shown, workers publish it on their own.
+  void Hide(WidgetBinding& binding, WidgetView::Hidden reason, bool hidden) {
+    if (!scheduler_.Hide(binding.view.get(), reason, hidden)) return;
+    // The collector keeps sampling for other renderers.
+    if (binding.subscriber) return;
+    auto visible = binding.view->IsVisible();
+    sample::Scheduler::Get().SetVisible(binding.widget, visible);
+    try {
+      if (binding.worker) {
+        binding.worker->SetVisible(visible);
+        return;
+      }
+      binding.widget->SetVisible(visible);
+      if (visible) scheduler_.SetState(binding.view.get(), binding.GetState());
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+    }
+  }
+
+  void Hide(xcb_window_t window, WidgetView::Hidden reason, bool hidden) {
+    for (auto& it : widgets_) {
+      if (!it.view) continue;
+      if (compositor_ ? window == compositor_->GetWindow() : *it.view == window) Hide(it, reason, hidden);
+    }
+  }
+
+  // Compositing managers redirect every window, which then never reports being obscured.
+  void HandleEvent(xcb_generic_event_t* evt) {
+    if (cache_.Handle(evt)) return;
+    if (screen_.Handle(evt)) {
+      for (auto& it : widgets_) {
+        if (it.view) Hide(it, WidgetView::kBlanked, screen_.IsBlanked());
+      }
+      return;
+    }
+    switch (evt->response_type & ~0x80) {
+      case XCB_MAP_NOTIFY:
+        Hide(reinterpret_cast<xcb_map_notify_event_t*>(evt)->window, WidgetView::kUnmapped, false);
+        return;
+      case XCB_UNMAP_NOTIFY:
+        Hide(reinterpret_cast<xcb_unmap_notify_event_t*>(evt)->window, WidgetView::kUnmapped, true);
+        return;
+      case XCB_VISIBILITY_NOTIFY: {
+        auto req = reinterpret_cast<xcb_visibility_notify_event_t*>(evt);
+        Hide(req->window, WidgetView::kObscured, req->state == XCB_VISIBILITY_FULLY_OBSCURED);
+        return;
+      }
+      default:
+        break;
+    }
+    if (compositor_) {
+      HandleComposite(evt);
+      return;
+    }
+    switch (evt->response_type & ~0x80) {
+      case XCB_EXPOSE: {
+        auto req = reinterpret_cast<xcb_expose_event_t*>(evt);
+        auto view = FindView(req->window);
+        if (view) {
+          scheduler_.Invalidate(view, {static_cast<int16_t>(req->x), static_cast<int16_t>(req->y),
+                                       req->width, req->height});
+        }
+        break;
+      }
+      case XCB_RESIZE_REQUEST: {
+        auto req = reinterpret_cast<xcb_resize_request_event_t*>(evt);
+        auto view = FindView(req->window);
+        if (view) scheduler_.Resize(view, req->width, req->height);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+ public:
+  XcbHandler(xcb_connection_t* conn, FrameScheduler& scheduler, PixmapCache& cache, Compositor* compositor,
+             ScreenMonitor& screen, WidgetsBinding& widgets) :
+      conn_(conn), scheduler_(scheduler), cache_(cache), compositor_(compositor), screen_(screen), widgets_(widgets),
+      stats_({0, 0}) {}
+
+  void Handle(const pollfd&) override {
+    for (;;) {
+      xcb::Event evt(xcb_poll_for_event(conn_), &free);
+      if (!evt) break;
+      HandleEvent(evt.get());
+      ++stats_.events;
+    }
+    ++stats_.batches;
+  }
+
+  const Stats& GetStats() const {
+    return stats_;
+  }
+};
+
+// Follows the states published by a collector. Icons are embedded once the backend of their slot
+// published a state, later changes are drawn like those of local widgets.
+class Mirror : public event::Handler {
+ private:
+  shared::Subscriber& subscriber_;
+  FrameScheduler& scheduler_;
+  Startup& startup_;
+  WidgetsBinding& widgets_;
+
+  // Widgets of the same build exist in this process too, only their backends are never started.
+  void Add(size_t slot) {
+    auto name = subscriber_.GetName(slot);
+    auto widget = std::find_if(WidgetList::Get().begin(), WidgetList::Get().end(), [name](auto op) {
+      return !std::strcmp(op->GetName(), name);
+    });
+    if (widget == WidgetList::Get().end()) return;
+    widgets_.emplace_back(scheduler_, startup_, *widget);
+    widgets_.back().subscriber = &subscriber_;
+    widgets_.back().slot = slot;
+    startup_.Mirror(widgets_.back());
+  }
+
+ public:
+  Mirror(shared::Subscriber& subscriber, FrameScheduler& scheduler, Startup& startup, WidgetsBinding& widgets) :
+      subscriber_(subscriber), scheduler_(scheduler), startup_(startup), widgets_(widgets) {}
+
+  // Slots of a restarting collector have no icon until their backend is ready again, the last
+  // state stays on screen meanwhile.
+  void Handle(const pollfd&) override {
+    subscriber_.Acknowledge();
+    for (size_t slot = 0, count = subscriber_.GetCount(); slot < count; ++slot) {
+      auto state = subscriber_.Read(slot);
+      if (!state.icon) continue;
+      auto it = std::find_if(widgets_.begin(), widgets_.end(), [slot](const auto& op) {
+        return op.subscriber && op.slot == slot;
+      });
+      if (it == widgets_.end()) Add(slot);
+      else if (it->view) scheduler_.SetState(it->view.get(), state);
+    }
+  }
+};
+
+// Runs the backends of every widget, a collector publishes their states to renderers on any number
+// of displays instead of drawing them.
+class Publication : public event::Handler {
+ private:
+  event::Reactor& reactor_;
+  shared::Publisher& publisher_;
+  Widget* widget_;
+  size_t slot_;
+  bool bound_;
+  std::unique_ptr<Worker> worker_;
+  std::future<void> started_;
+
+  void Fail(const std::exception& ex) {
+    util::PrintException(ex);
+    reactor_.Remove(this);
+    sample::Scheduler::Get().Remove(widget_);
+    if (bound_) widget_->Bind(nullptr, nullptr);
+    bound_ = false;
+    worker_.reset();
+  }
+
+ public:
+  Publication(event::Reactor& reactor, shared::Publisher& publisher, Widget* widget) :
+      reactor_(reactor), publisher_(publisher), widget_(widget), slot_(publisher.Add(widget->GetName())),
+      bound_(false) {}
+
+  ~Publication() {
+    if (bound_) widget_->Bind(nullptr, nullptr);
+  }
+
+  void Start(int argc, char** argv, bool threaded) {
+    try {
+      if (threaded && widget_->MayBlock()) {
+        worker_ = std::make_unique<Worker>(widget_);
+        started_ = worker_->Start(argc, argv);
+        reactor_.Add(worker_->GetFd(), POLLIN, this);
+        return;
+      }
+      bound_ = true;
+      widget_->Bind(&reactor_, this);
+      widget_->Init(argc, argv);
+    } catch (const std::exception& ex) {
+      Fail(ex);
+      return;
+    }
+    publisher_.Publish(slot_, widget_->GetState());
+  }
+
+  // Workers without a timeout, a backend stuck in Init only leaves its slot without an icon.
+  void Handle(const pollfd& fd) override {
+    if (started_.valid()) {
+      try {
+        started_.get();
+      } catch (const std::exception&) {
+        try {
+          std::throw_with_nested(std::runtime_error(std::string("Failed to initialize ") + widget_->GetName()));
+        } catch (const std::exception& ex) {
+          Fail(ex);
+        }
+        return;
+      }
+    }
+    if (!worker_) widget_->Handle(fd);
+    publisher_.Publish(slot_, worker_ ? worker_->Read() : widget_->GetState());
+  }
+};
+
+// Signals are only read from a signalfd. Threads inherit the mask they are created with, so this
+// runs before the first one, otherwise a signal may hit a thread that still takes the default action.
+sigset_t BlockSignals() {
+  sigset_t result;
+  sigemptyset(&result);
+  for (auto it : {SIGUSR1, SIGINT, SIGTERM})
+    sigaddset(&result, it);
+  auto error = pthread_sigmask(SIG_BLOCK, &result, nullptr);
+  if (error) throw std::system_error(error, std::system_category(), "Failed to block signals");
+  return result;
+}
+
+// Statistics of the renderer, reported on SIGUSR1.
+class Statistics {
+ private:
+  using Clock = std::chrono::steady_clock;
+  using Minutes = std::chrono::duration<double, std::ratio<60>>;
+
+  const event::Reactor& reactor_;
+  const WidgetsBinding& widgets_;
+  const XcbHandler& xcb_handler_;
+  const FrameScheduler& scheduler_;
+  const PixmapCache& cache_;
+  const Startup& startup_;
+  Clock::time_point begin_;
+  Clock::time_point last_report_;
+  unsigned long last_wakeups_;
+
+  // Wakeups of the main thread and every worker, per minute since start and since the last report.
+  void ReportWakeups(std::ostream& out) {
+    auto total = reactor_.GetWakeups();
+    for (const auto& it : widgets_) {
+      if (it.worker) total += it.worker->GetWakeups();
+    }
+    auto now = Clock::now();
+    out << std::fixed << std::setprecision(1);
+    out << "wakeups: " << total << " total, " << total / Minutes(now - begin_).count() << "/min since start, "
+        << (total - last_wakeups_) / Minutes(now - last_report_).count() << "/min since last report" << std::endl;
+    out << "wakeups: main " << reactor_.GetWakeups();
+    for (const auto& it : widgets_) {
+      if (it.worker) out << ", " << it.widget->GetName() << " " << it.worker->GetWakeups();
+    }
+    out << std::endl;
+    out.unsetf(std::ios::floatfield);
+    last_report_ = now;
+    last_wakeups_ = total;
+  }
+
+ public:
+  Statistics(const event::Reactor& reactor, const WidgetsBinding& widgets, const XcbHandler& xcb_handler,
+             const FrameScheduler& scheduler, const PixmapCache& cache, const Startup& startup) :
+      reactor_(reactor), widgets_(widgets), xcb_handler_(xcb_handler), scheduler_(scheduler), cache_(cache),
+      startup_(startup), begin_(Clock::now()), last_report_(begin_), last_wakeups_(0) {}
+
+  void Report(std::ostream& out) {
+    const auto& xcb = xcb_handler_.GetStats();
+    const auto& frames = scheduler_.GetStats();
+    out << "xcb: " << xcb.events << " events in " << xcb.batches << " batches" << std::endl;
+    out << "frames: " << frames.repairs << " repairs in " << frames.frames << " frames, "
+        << frames.coalesced << " coalesced, " << frames.unchanged << " unchanged, "
+        << frames.deferred << " deferred while hidden" << std::endl;
+    const auto& cache = cache_.GetStats();
+    out << "pixmaps (" << cache_.GetBackendName() << "): " << cache.hits << " hits, " << cache.misses << " misses, "
+        << cache.evictions << " evictions" << std::endl;
+    startup_.Report(out);
+    ReportWakeups(out);
+  }
+};
+
+// SIGUSR1 dumps statistics and traces, SIGINT and SIGTERM stop the main loop.
+class SignalHandler : public event::Handler {
+ private:
+  int fd_;
+  std::function<void(std::ostream&)> report_;
+  bool stopped_;
+
+ public:
+  // The mask has to be blocked in every thread already, see BlockSignals.
+  SignalHandler(const sigset_t& mask, std::function<void(std::ostream&)> report) :
+      fd_(signalfd(-1, &mask, SFD_CLOEXEC)), report_(std::move(report)), stopped_(false) {
+    if (fd_ < 0) util::ThrowSystemError("Failed to create signalfd");
+  }
+
+  ~SignalHandler() {
+    close(fd_);
   }
+
+  int GetFd() const {
+    return fd_;
+  }
+
+  bool IsStopped() const {
+    return stopped_;
+  }
+
+  void Handle(const pollfd&) override {
+    signalfd_siginfo info;
+    if (read(fd_, &info, sizeof(info)) != sizeof(info)) return;
+    if (info.ssi_signo != SIGUSR1) {
+      stopped_ = true;
+      return;
+    }
+    report_(std::cerr);
+    if (!trace::kEnabled) return;
+    trace::Dump(std::cerr);
+    try {
+      trace::Export();
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+    }
+  }
+};
+
+// Runs until SIGINT or SIGTERM, the region is removed on the way out. It is only left behind when
+// killed, so a restarted collector takes it over. Renderers keep showing the last states.
+void RunCollector(const sigset_t& signals, const char* name, int argc, char** argv) {
+  event::Reactor reactor;
+  ReactorScope reactor_scope(reactor);
+  shared::Publisher publisher(name);
+  auto workers = std::getenv("LAPS2_WORKERS");
+  auto threaded = !workers || std::atoi(workers);
+  std::list<Publication> publications;
+  for (auto it : WidgetList::Get()) {
+    publications.emplace_back(reactor, publisher, it);
+    publications.back().Start(argc, argv, threaded);
+  }
+  SignalHandler signal_handler(signals, [&reactor](std::ostream& out) {
+    out << "wakeups: main " << reactor.GetWakeups() << std::endl;
+  });
+  reactor.Add(signal_handler.GetFd(), POLLIN, &signal_handler);
+  while (!signal_handler.IsStopped())
+    reactor.Wait(-1);
+}
+
+// Widget replayed without a display, its view draws into a framebuffer right away.
+class Playback : public event::Handler {
+ private:
+  event::Reactor& reactor_;
+  Widget* widget_;
+  WidgetView view_;
+  bool bound_;
+  unsigned long frames_;
+
+  void Update() {
+    if (!view_.SetState(widget_->GetState())) return;
+    view_.Damage(view_.GetArea());
+    view_.Repair();
+    ++frames_;
+  }
+
+ public:
+  Playback(event::Reactor& reactor, Widget* widget) :
+      reactor_(reactor), widget_(widget),
+      view_(widget->GetName(), std::make_unique<FramebufferSurface>(), kHeadlessSize, kHeadlessSize),
+      bound_(false), frames_(0) {}
+
+  ~Playback() {
+    if (bound_) widget_->Bind(nullptr, nullptr);
+  }
+
+  void Start(int argc, char** argv) {
+    try {
+      bound_ = true;
+      widget_->Bind(&reactor_, this);
+      widget_->Init(argc, argv);
+      Update();
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+      reactor_.Remove(this);
+      sample::Scheduler::Get().Remove(widget_);
+      widget_->Bind(nullptr, nullptr);
+      bound_ = false;
+    }
+  }
+
+  void Handle(const pollfd& fd) override {
+    widget_->Handle(fd);
+    Update();
+  }
+
+  void Report(std::ostream& out) const {
+    out << widget_->GetName() << ": " << frames_ << " frames" << std::endl;
+  }
+};
+
+// Replays the inputs on the main thread when there is no display to draw on, until every one of
+// them was played or a signal stops it.
+void RunHeadless(const sigset_t& signals, int argc, char** argv) {
+  event::Reactor reactor;
+  ReactorScope reactor_scope(reactor);
+  std::list<Playback> playbacks;
+  for (auto it : WidgetList::Get()) {
+    playbacks.emplace_back(reactor, it);
+    playbacks.back().Start(argc, argv);
+  }
+  auto report = [&reactor, &playbacks](std::ostream& out) {
+    for (const auto& it : playbacks)
+      it.Report(out);
+    out << "wakeups: main " << reactor.GetWakeups() << std::endl;
+  };
+  SignalHandler signal_handler(signals, report);
+  reactor.Add(signal_handler.GetFd(), POLLIN, &signal_handler);
+  while (replay::IsPlaying() && !signal_handler.IsStopped())
+    reactor.Wait(-1);
+  report(std::cerr);
 }
 
 }  // namespace
 
 int main(int argc, char** argv) {
   try {
+    auto signals = BlockSignals();
+    // Backends run without a display when LAPS2_COLLECT names a shared region.
+    auto collect = std::getenv("LAPS2_COLLECT");
+    if (collect) {
+      RunCollector(signals, collect, argc, argv);
+      return 0;
+    }
     int screen_number;
     xcb::Connection conn(xcb_connect(nullptr, &screen_number), &xcb_disconnect);
+    if (replay::kReplaying && xcb_connection_has_error(conn.get())) {
+      RunHeadless(signals, argc, argv);
+      return 0;
+    }
+    event::Reactor reactor;
+    ReactorScope reactor_scope(reactor);
+    auto interval = std::getenv("LAPS2_FRAME_INTERVAL");
+    FrameScheduler scheduler(conn.get(), interval ? std::max(std::atoi(interval), 0) : kDefaultFrameInterval);
+    reactor.Add(scheduler.GetFd(), POLLIN, &scheduler);
+    auto renderer = std::getenv("LAPS2_RENDERER");
+    auto backend = renderer && !std::strcmp(renderer, "raster") ? PixmapCache::kRaster : PixmapCache::kPolygons;
+    PixmapCache cache(conn.get(), kPixmapCacheSize, backend);
+    // All icons share one tray window when LAPS2_COMPOSITE is set.
+    auto composite = std::getenv("LAPS2_COMPOSITE");
+    std::unique_ptr<Compositor> compositor;
+    if (composite && std::atoi(composite)) compositor = std::make_unique<Compositor>(conn.get(), cache);
+    // Widgets keeping a history show it as a sparkline when LAPS2_TRENDS is set.
+    auto trends = std::getenv("LAPS2_TRENDS");
+    // Everything the views need from the server is fetched in a constant number of round-trips.
+    xcb::Atoms atoms(conn.get());
+    atoms.Prefetch({xcb::TraySelection(screen_number), "_NET_SYSTEM_TRAY_OPCODE"});
+    auto tray = xcb::FindTray(conn.get(), atoms, screen_number);
+    auto workers = std::getenv("LAPS2_WORKERS");
+    auto threaded = !workers || std::atoi(workers);
+    auto timeout = std::getenv("LAPS2_INIT_TIMEOUT");
+    // States are read from the region of a collector instead when LAPS2_SHARED is set.
+    auto shared_name = std::getenv("LAPS2_SHARED");
+    std::unique_ptr<shared::Subscriber> subscriber;
+    if (shared_name) subscriber = std::make_unique<shared::Subscriber>(shared_name);
     WidgetsBinding widgets;
-    for (auto it : WidgetList::Get()) try {
-      it->Init(argc, argv);
-      WidgetView view(conn.get(), screen_number);
-      view.SetState(it->GetState());
-      widgets.emplace_back(it, std::move(view));
-    } catch (const std::exception& ex) {
-      util::PrintException(ex);
+    Startup startup(conn.get(), reactor, cache, compositor.get(), trends && std::atoi(trends), atoms, tray, widgets,
+                    timeout ? std::max(std::atoi(timeout), 1) : kDefaultInitTimeout);
+    reactor.Add(startup.GetFd(), POLLIN, &startup);
+    // Threaded backends go first, so they initialize while the main thread ones do.
+    std::stable_partition(WidgetList::Get().begin(), WidgetList::Get().end(), [threaded](auto op) {
+      return threaded && op->MayBlock();
+    });
+    std::unique_ptr<Mirror> mirror;
+    if (subscriber) {
+      mirror = std::make_unique<Mirror>(*subscriber, scheduler, startup, widgets);
+      reactor.Add(subscriber->GetFd(), POLLIN, mirror.get());
     }
-    xcb_flush(conn.get());
-    for (;;) {
-      std::vector<pollfd> fds = {{xcb_get_file_descriptor(conn.get()), POLLIN}};
-      for (const auto& it : widgets) {
-        const auto& widget_fds = it.first->GetPollFds();
-        fds.insert(fds.end(), widget_fds.begin(), widget_fds.end());
-      }
-      if (poll(fds.data(), fds.size(), -1) < 0)
-        util::ThrowSystemError("Polling failed");
-      if (fds[0].revents & POLLIN) {
-        xcb::Event evt(xcb_poll_for_event(conn.get()), &free);
-        if (!evt) break;
-        HandleXcbEvent(conn.get(), evt.get(), widgets);
+    if (!subscriber) {
+      for (auto it : WidgetList::Get()) {
+        widgets.emplace_back(scheduler, startup, it);
+        startup.Start(widgets.back(), argc, argv, threaded);
       }
-      for (const auto& it : fds) {
-        if (it.revents)
-          HandleWidgetEvent(conn.get(), it, widgets);
-      }
-      xcb_flush(conn.get());
     }
+    // Icons are not drawn while the screen saver runs or the monitor is powered down.
+    ScreenMonitor screen(conn.get(), xcb_setup_roots_iterator(xcb_get_setup(conn.get())).data->root);
+    XcbHandler xcb_handler(conn.get(), scheduler, cache, compositor.get(), screen, widgets);
+    reactor.Add(xcb_get_file_descriptor(conn.get()), POLLIN, &xcb_handler);
+    Statistics statistics(reactor, widgets, xcb_handler, scheduler, cache, startup);
+    SignalHandler signal_handler(signals, [&statistics](std::ostream& out) {
+      statistics.Report(out);
+    });
+    reactor.Add(signal_handler.GetFd(), POLLIN, &signal_handler);
+    // Replies read during startup may have queued events already.
+    xcb_handler.Handle({});
+    xcb_flush(conn.get());
+    while (!xcb_connection_has_error(conn.get()) && !signal_handler.IsStopped())
+      reactor.Wait(-1);
     return 0;
   } catch (const std::exception& ex) {
     util::PrintException(ex);
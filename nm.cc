@@ -1,98 +1,170 @@
 #include "dbus.h"
 #include "nm_glue.h"
+#include "replay.h"
 #include "resources.h"
 #include "widget.h"
-#include <algorithm>
+#include <unordered_map>
 
 namespace {
 
-const char kDBusApFilter[] = "type='signal',interface='org.freedesktop.NetworkManager.AccessPoint'";
 const char kDBusApIface[] = "org.freedesktop.NetworkManager.AccessPoint";
 const char kDBusConIface[] = "org.freedesktop.NetworkManager.Connection.Active";
 const char kDBusDest[] = "org.freedesktop.NetworkManager";
 const char kDBusNmIface[] = "org.freedesktop.NetworkManager";
 const char kDBusNmPath[] = "/org/freedesktop/NetworkManager";
+const char kDBusPropIface[] = "org.freedesktop.DBus.Properties";
 
-const uint8_t* kSignalLevel[] = {
-  wifi_00, wifi_01, wifi_02, wifi_03, wifi_04
+// Arcs are revealed bottom up with the signal strength.
+const IconFill kSignalFill = {&wifi_arcs, nullptr, IconFill::kY, 192, 16};
+const Icon kSignal = {wifi.polygons, wifi.count, wifi.max_points, &kSignalFill};
+const icon::Registration kRegistration({&ethernet, &kSignal});
+
+// Object whose properties are filled by GetAll and updated from PropertiesChanged.
+struct Object {
+  const char* iface;
+  std::string path;
+  unsigned long subscription;
 };
 
+using Properties = dbus::Dict<dbus::StringView, dbus::Variant>;
+
+void Assign(std::string& target, const dbus::Variant& value) {
+  auto view = value.Get<dbus::StringView>();
+  target.assign(view.data, view.size);
+}
+
 struct NmWidget : public Widget {
-  std::list<dbus::Watch> watches_;
-  const uint8_t* icon_;
-
-  std::unique_ptr<dbus::Connection> connection_;
-
-  std::string GetSingleProperty(const std::string& path, const std::string& iface, const std::string& prop) {
-    try {
-      const char kPropCommand[] = "Get";
-      const char kPropIface[] = "org.freedesktop.DBus.Properties";
-      const char* iface_name = iface.c_str();
-      const char* prop_name = prop.c_str();
-      dbus::Message get_prop(dbus_message_new_method_call(kDBusDest, path.c_str(), kPropIface, kPropCommand));
-      dbus_message_append_args(get_prop,
-          DBUS_TYPE_STRING, &iface_name,
-          DBUS_TYPE_STRING, &prop_name,
-          DBUS_TYPE_INVALID);
-      const auto& reply = dbus::Parse(dbus::Request(*connection_, get_prop));
-      if (reply.empty()) throw std::runtime_error("Invalid reply format");
-      return reply.front().second.data;
-    } catch (const std::exception&) {
-      std::throw_with_nested(std::runtime_error("Failed to get property"));
+  IconState state_;
+  std::unique_ptr<replay::Player> player_;
+
+  Object manager_{kDBusNmIface};
+  Object active_{kDBusConIface};
+  Object access_point_{kDBusApIface};
+
+  std::string primary_connection_;
+  std::string type_;
+  std::string specific_object_;
+  int strength_{-1};
+
+  void Reset(const Object& object) {
+    if (&object == &manager_) {
+      primary_connection_.clear();
+    } else if (&object == &active_) {
+      type_.clear();
+      specific_object_.clear();
+    } else {
+      strength_ = -1;
     }
   }
 
-  void Init(int argc, char** argv) override {
-    // TODO(Micha): Parse commandline arguments
-    connection_ = std::make_unique<decltype(connection_)::element_type>(DBUS_BUS_SYSTEM);
-    auto watch_rc = dbus_connection_set_watch_functions(*connection_,
-        NmWidget::OnAddWatch, NmWidget::OnRemoveWatch, nullptr, this, nullptr);
-    if (!watch_rc) throw std::runtime_error("Failed to setup dbus watch functions");
-    dbus::Error error;
-    dbus_bus_add_match(*connection_, kDBusApFilter, error);
-    if (error.IsSet()) throw error;
-    icon_ = kSignalLevel[0];
+  void Apply(const Object& object, const Properties& properties) {
+    properties.ForEach([this, &object](const auto& key, const auto& value) {
+      if (&object == &manager_ && key == "PrimaryConnection") Assign(primary_connection_, value);
+      else if (&object == &active_ && key == "Type") Assign(type_, value);
+      else if (&object == &active_ && key == "SpecificObject") Assign(specific_object_, value);
+      else if (&object == &access_point_ && key == "Strength") strength_ = value.template Get<uint8_t>();
+    });
+  }
+
+  // Match rules follow the objects currently in use, so signals of other access points never wake us up.
+  void Bind(Object& object, const std::string& path) {
+    if (object.path == path) return;
+    auto& bus = dbus::Bus::Get();
+    if (object.subscription) bus.Unsubscribe(object.subscription);
+    object.path = path;
+    object.subscription = 0;
+    Reset(object);
+    if (path.empty() || path == "/") return;
+    object.subscription = bus.Subscribe(path, kDBusPropIface, "PropertiesChanged", [this](DBusMessage* message) {
+      OnPropertiesChanged(message);
+    });
+    GetAll(object);
   }
 
-  const uint8_t* GetState() override {
-    return icon_;
+  void GetAll(Object& object) {
+    const char kPropCommand[] = "GetAll";
+    dbus::Message get_all(dbus_message_new_method_call(kDBusDest, object.path.c_str(), kDBusPropIface, kPropCommand));
+    dbus_message_append_args(get_all, DBUS_TYPE_STRING, &object.iface, DBUS_TYPE_INVALID);
+    auto path = object.path;
+    dbus::RequestAsync(dbus::Bus::Get().GetConnection(), get_all, [this, &object, path](dbus::Message&& reply) {
+      try {
+        Properties properties;
+        dbus::Decode(reply, properties);
+        // Object might have been rebound while the request was in flight.
+        if (object.path != path) return;
+        Apply(object, properties);
+        OnChanged(object);
+      } catch (const std::exception&) {
+        std::throw_with_nested(std::runtime_error("Failed to get properties of " + path));
+      }
+    });
   }
 
-  std::vector<pollfd> GetPollFds() override {
-    decltype(GetPollFds()) result;
-    for (auto& it : watches_) {
-      if (!it.IsEnabled()) continue;
-      short flags = dbus_watch_get_flags(it);
-      result.push_back({it.GetFd(), flags});
+  void OnChanged(Object& object) {
+    if (&object == &manager_) Bind(active_, primary_connection_);
+    if (&object != &access_point_) Bind(access_point_, type_ == nm::kEthType ? std::string() : specific_object_);
+    // Only what the icon depends on is recorded, replay needs no bus objects.
+    if (replay::kRecording) {
+      replay::Record(GetName(), "type", type_);
+      replay::Record(GetName(), "strength", std::to_string(strength_));
     }
-    return result;
+    UpdateIcon();
+    Notify();
   }
 
-  void Activate() override {
+  void Replay(const std::string& key, const std::string& value) {
+    if (key == "type") type_ = value;
+    else if (key == "strength") strength_ = std::atoi(value.c_str());
+    UpdateIcon();
   }
 
-  void Handle(const pollfd&) override {
-    dbus_connection_read_write_dispatch(*connection_, -1);
-    const auto& connection = GetSingleProperty(kDBusNmPath, kDBusNmIface, "PrimaryConnection");
-    const auto& type = GetSingleProperty(connection, kDBusConIface, "Type");
-    if (type == nm::kEthType) {
-      icon_ = ethernet;
+  // Anything but ethernet or a wifi with a known strength, a vpn or no connection at all, shows
+  // the empty signal instead of keeping the last icon.
+  void UpdateIcon() {
+    if (type_ == nm::kEthType) state_ = {&ethernet, 0};
+    else if (type_ == nm::kWifiType && strength_ >= 0) state_ = {&kSignal, icon::Level(strength_, 0, 100)};
+    else state_ = {&kSignal, 0};
+  }
+
+  void OnPropertiesChanged(DBusMessage* message) {
+    auto path = dbus_message_get_path(message);
+    if (!path) return;
+    dbus::StringView iface;
+    Properties changed;
+    dbus::Decode(message, iface, changed);
+    for (auto object : {&manager_, &active_, &access_point_}) {
+      if (object->path != path || iface != object->iface) continue;
+      Apply(*object, changed);
+      OnChanged(*object);
+    }
+  }
+
+  void Init(int argc, char** argv) override {
+    // TODO(Micha): Parse commandline arguments
+    state_ = {&kSignal, 0};
+    if (replay::kReplaying) {
+      player_ = std::make_unique<replay::Player>(GetName());
+      Watch(player_->GetFd(), POLLIN);
+      player_->Play([this](const auto& key, const auto& value) { Replay(key, value); });
       return;
     }
-    const auto& access_point = GetSingleProperty(connection, kDBusConIface, "SpecificObject");
-    auto strength = std::stoi(GetSingleProperty(access_point, kDBusApIface, "Strength").c_str());
-    icon_ = kSignalLevel[strength * util::Length(kSignalLevel) / 100];
+    Bind(manager_, kDBusNmPath);
   }
 
-  static dbus_bool_t OnAddWatch(DBusWatch* watch, void* data) {
-    auto self = reinterpret_cast<NmWidget*>(data);
-    self->watches_.push_back(watch);
-    return true;
+  IconState GetState() override {
+    return state_;
   }
 
-  static void OnRemoveWatch(DBusWatch* watch, void* data) {
-    auto self = reinterpret_cast<NmWidget*>(data);
-    self->watches_.remove(watch);
+  void Activate() override {
+  }
+
+  const char* GetName() override {
+    return "nm";
+  }
+
+  // Replies and signals arrive through the shared bus, which notifies about changes.
+  void Handle(const pollfd&) override {
+    if (player_) player_->Play([this](const auto& key, const auto& value) { Replay(key, value); });
   }
 } __impl__;
 
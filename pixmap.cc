@@ -0,0 +1,174 @@
+#include "pixmap.h"
+#include <algorithm>
+#include <iostream>
+
+namespace {
+
+xcb_gcontext_t CreateContext(xcb_connection_t* conn, xcb_window_t root, uint32_t color) {
+  auto result = xcb_generate_id(conn);
+  uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
+  uint32_t values[] = {color, 0};
+  xcb_create_gc(conn, result, root, mask, values);
+  return result;
+}
+
+// Raster output is written as 8 bit per channel TrueColor in native byte order.
+bool SupportsRaster(xcb_connection_t* conn, xcb_screen_t* screen) {
+  auto setup = xcb_get_setup(conn);
+  const uint32_t kEndianness = 1;
+  auto native_order = *reinterpret_cast<const uint8_t*>(&kEndianness) ?
+      XCB_IMAGE_ORDER_LSB_FIRST : XCB_IMAGE_ORDER_MSB_FIRST;
+  if (setup->image_byte_order != native_order) return false;
+  auto formats = xcb_setup_pixmap_formats(setup);
+  auto format = std::find_if(formats, formats + xcb_setup_pixmap_formats_length(setup), [screen](const auto& op) {
+    return op.depth == screen->root_depth && op.bits_per_pixel == 32;
+  });
+  if (format == formats + xcb_setup_pixmap_formats_length(setup)) return false;
+  for (auto depths = xcb_screen_allowed_depths_iterator(screen); depths.rem; xcb_depth_next(&depths)) {
+    for (auto visuals = xcb_depth_visuals_iterator(depths.data); visuals.rem; xcb_visualtype_next(&visuals)) {
+      if (visuals.data->visual_id != screen->root_visual) continue;
+      return visuals.data->_class == XCB_VISUAL_CLASS_TRUE_COLOR &&
+          visuals.data->red_mask == 0xff0000 &&
+          visuals.data->green_mask == 0xff00 &&
+          visuals.data->blue_mask == 0xff;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+bool PixmapCache::Key::operator==(const Key& op) const {
+  return icon == op.icon && level == op.level && width == op.width && height == op.height && depth == op.depth;
+}
+
+size_t PixmapCache::KeyHash::operator()(const Key& op) const {
+  auto hash = std::hash<const Icon*>()(op.icon);
+  hash ^= static_cast<size_t>(op.level) * 0x9e3779b97f4a7c15ull;
+  return hash ^ (static_cast<size_t>(op.width) << 24 | static_cast<size_t>(op.height) << 8 | op.depth);
+}
+
+PixmapCache::PixmapCache(xcb_connection_t* conn, size_t capacity, Backend backend) :
+    conn_(conn),
+    backend_(backend),
+    capacity_(std::max<size_t>(capacity, 1)),
+    scratch_(XCB_PIXMAP_NONE),
+    scratch_key_({nullptr, 0, 0, 0, 0}),
+    stats_({0, 0, 0}) {
+  auto screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+  root_ = screen->root;
+  depth_ = screen->root_depth;
+  background_ = CreateContext(conn, root_, screen->white_pixel);
+  foreground_ = CreateContext(conn, root_, screen->black_pixel);
+  index_.reserve(capacity);
+  if (backend_ == kRaster && !SupportsRaster(conn, screen)) {
+    std::cerr << "Visual is not supported by raster backend, falling back to polygons" << std::endl;
+    backend_ = kPolygons;
+  }
+  if (backend_ == kRaster) {
+    rasterizer_ = std::make_unique<raster::Rasterizer>();
+    image_ = std::make_unique<xcb::Image>(conn);
+  }
+}
+
+PixmapCache::~PixmapCache() {
+  for (auto it = entries_.begin(); it != entries_.end();)
+    it = Erase(it);
+  if (scratch_ != XCB_PIXMAP_NONE) xcb_free_pixmap(conn_, scratch_);
+  xcb_free_gc(conn_, background_);
+  xcb_free_gc(conn_, foreground_);
+}
+
+void PixmapCache::RenderPolygons(const Key& key, const Icon& icon, xcb_pixmap_t pixmap) {
+  xcb_rectangle_t area = {0, 0, key.width, key.height};
+  xcb_poly_fill_rectangle(conn_, pixmap, background_, 1, &area);
+  if (points_.size() < icon.max_points) points_.resize(icon.max_points);
+  for (size_t i = 0; i < icon.count; ++i) {
+    const auto& polygon = *icon.polygons[i];
+    for (size_t j = 0; j < polygon.count; ++j) {
+      auto ptr = polygon.points + j * 2;
+      points_[j] = {static_cast<int16_t>(key.width * ptr[0] >> 8), static_cast<int16_t>(key.height * ptr[1] >> 8)};
+    }
+    xcb_fill_poly(conn_, pixmap, foreground_, XCB_POLY_SHAPE_NONCONVEX, XCB_COORD_MODE_ORIGIN,
+                  polygon.count, points_.data());
+  }
+}
+
+void PixmapCache::RenderRaster(const Key& key, const Icon& icon, xcb_pixmap_t pixmap) {
+  size_t count = key.width * key.height;
+  coverage_.resize(count);
+  rasterizer_->Render(icon, key.width, key.height, coverage_.data());
+  auto pixels = image_->Reserve(key.width, key.height);
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t value = 0xff - coverage_[i];
+    pixels[i] = 0xff000000 | value << 16 | value << 8 | value;
+  }
+  image_->Put(pixmap, foreground_, key.depth, key.width, key.height);
+}
+
+void PixmapCache::Fill(const Key& key, const Icon& icon, xcb_pixmap_t pixmap) {
+  if (backend_ == kRaster) RenderRaster(key, icon, pixmap);
+  else RenderPolygons(key, icon, pixmap);
+}
+
+xcb_pixmap_t PixmapCache::Render(const Key& key, const Icon& icon) {
+  auto result = xcb_generate_id(conn_);
+  xcb_create_pixmap(conn_, key.depth, result, root_, key.width, key.height);
+  Fill(key, icon, result);
+  return result;
+}
+
+std::list<PixmapCache::Entry>::iterator PixmapCache::Erase(std::list<Entry>::iterator it) {
+  xcb_free_pixmap(conn_, it->pixmap);
+  index_.erase(it->key);
+  return entries_.erase(it);
+}
+
+xcb_pixmap_t PixmapCache::Get(const IconState& state, int width, int height) {
+  Key key = {state.icon, static_cast<uint16_t>(icon::Bucket(state, width, height)),
+             static_cast<uint16_t>(width), static_cast<uint16_t>(height), depth_};
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    entries_.splice(entries_.begin(), entries_, it->second);
+    ++stats_.hits;
+    return it->second->pixmap;
+  }
+  ++stats_.misses;
+  if (entries_.size() >= capacity_) {
+    Erase(std::prev(entries_.end()));
+    ++stats_.evictions;
+  }
+  entries_.push_front({key, Render(key, *instance_.Build(state, width, height))});
+  index_.emplace(key, entries_.begin());
+  return entries_.front().pixmap;
+}
+
+// Requests are ordered, so copies from the previous contents are done before it is filled again.
+xcb_pixmap_t PixmapCache::Draw(const Icon& icon, int width, int height) {
+  Key key = {&icon, 0, static_cast<uint16_t>(width), static_cast<uint16_t>(height), depth_};
+  if (scratch_ == XCB_PIXMAP_NONE || scratch_key_.width != key.width || scratch_key_.height != key.height) {
+    if (scratch_ != XCB_PIXMAP_NONE) xcb_free_pixmap(conn_, scratch_);
+    scratch_ = xcb_generate_id(conn_);
+    xcb_create_pixmap(conn_, depth_, scratch_, root_, key.width, key.height);
+  }
+  scratch_key_ = key;
+  Fill(key, icon, scratch_);
+  return scratch_;
+}
+
+PixmapCache::Backend PixmapCache::GetBackend() const {
+  return backend_;
+}
+
+bool PixmapCache::Handle(xcb_generic_event_t* evt) {
+  return image_ && image_->Handle(evt);
+}
+
+const char* PixmapCache::GetBackendName() const {
+  if (backend_ == kPolygons) return "polygons";
+  return image_->IsShared() ? "raster/shm" : "raster";
+}
+
+const PixmapCache::Stats& PixmapCache::GetStats() const {
+  return stats_;
+}
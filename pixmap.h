@@ -0,0 +1,86 @@
+#ifndef LAPS2_PIXMAP_H_
+#define LAPS2_PIXMAP_H_
+
+#include "icon.h"
+#include "raster.h"
+#include "util.h"
+#include "xcb.h"
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Least recently used cache of icons rasterized into server side pixmaps. Sizes no longer shown age
+// out, views of the same size share their entries.
+class PixmapCache : public util::NonCopyable {
+ public:
+  enum Backend {
+    kPolygons = 0,  // Server side aliased fill_poly
+    kRaster         // Client side anti-aliased rasterizer
+  };
+
+  // Parametric icons are cached per level bucket.
+  struct Key {
+    const Icon* icon;
+    uint16_t level;
+    uint16_t width;
+    uint16_t height;
+    uint8_t depth;
+    bool operator==(const Key& op) const;
+  };
+
+  struct Stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+  };
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key& op) const;
+  };
+
+  struct Entry {
+    Key key;
+    xcb_pixmap_t pixmap;
+  };
+
+  xcb_connection_t* conn_;
+  Backend backend_;
+  xcb_window_t root_;
+  uint8_t depth_;
+  xcb_gcontext_t background_;
+  xcb_gcontext_t foreground_;
+  size_t capacity_;
+  std::list<Entry> entries_;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+  icon::Instance instance_;
+  std::vector<xcb_point_t> points_;
+  std::unique_ptr<raster::Rasterizer> rasterizer_;
+  std::unique_ptr<xcb::Image> image_;
+  std::vector<uint8_t> coverage_;
+  xcb_pixmap_t scratch_;
+  Key scratch_key_;
+  Stats stats_;
+
+  void RenderPolygons(const Key& key, const Icon& icon, xcb_pixmap_t pixmap);
+  void RenderRaster(const Key& key, const Icon& icon, xcb_pixmap_t pixmap);
+  void Fill(const Key& key, const Icon& icon, xcb_pixmap_t pixmap);
+  xcb_pixmap_t Render(const Key& key, const Icon& icon);
+  std::list<Entry>::iterator Erase(std::list<Entry>::iterator it);
+
+ public:
+  PixmapCache(xcb_connection_t* conn, size_t capacity, Backend backend = kPolygons);
+  ~PixmapCache();
+  xcb_pixmap_t Get(const IconState& state, int width, int height);
+  // Icons that change with every draw are rendered into a single scratch pixmap instead, valid until
+  // the next call.
+  xcb_pixmap_t Draw(const Icon& icon, int width, int height);
+  // Uploads complete asynchronously, returns true for the events reporting it.
+  bool Handle(xcb_generic_event_t* evt);
+  Backend GetBackend() const;
+  const char* GetBackendName() const;
+  const Stats& GetStats() const;
+};
+
+#endif  // LAPS2_PIXMAP_H_
@@ -0,0 +1,187 @@
+#include "raster.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LAPS2_RASTER_X86
+#endif
+
+namespace {
+
+inline uint8_t Fold(float value) {
+  // Even-odd rule, odd winding numbers are inside.
+  auto y = std::fabs(value);
+  y -= 2.f * std::floor(y * .5f);
+  return static_cast<uint8_t>(std::min(1.f - std::fabs(1.f - y), 1.f) * 255.f + .5f);
+}
+
+void AccumulateScalar(const float* accum, uint8_t* coverage, size_t count, float acc) {
+  for (size_t i = 0; i < count; ++i) {
+    acc += accum[i];
+    coverage[i] = std::max(coverage[i], Fold(acc));
+  }
+}
+
+void AccumulateScalar(const float* accum, uint8_t* coverage, size_t count) {
+  AccumulateScalar(accum, coverage, count, 0.f);
+}
+
+#ifdef LAPS2_RASTER_X86
+
+inline __m128 FoldSse2(__m128 x) {
+  const auto sign = _mm_set1_ps(-0.f);
+  const auto one = _mm_set1_ps(1.f);
+  auto y = _mm_andnot_ps(sign, x);
+  // Truncation is floor for non negative values.
+  auto q = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(y, _mm_set1_ps(.5f))));
+  y = _mm_sub_ps(y, _mm_add_ps(q, q));
+  y = _mm_sub_ps(one, _mm_andnot_ps(sign, _mm_sub_ps(one, y)));
+  return _mm_mul_ps(y, _mm_set1_ps(255.f));
+}
+
+void AccumulateSse2(const float* accum, uint8_t* coverage, size_t count) {
+  auto carry = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    auto x = _mm_loadu_ps(accum + i);
+    x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+    x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+    x = _mm_add_ps(x, carry);
+    carry = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+    auto v = _mm_cvtps_epi32(FoldSse2(x));
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    int32_t old;
+    std::memcpy(&old, coverage + i, sizeof(old));
+    auto merged = _mm_cvtsi128_si32(_mm_max_epu8(v, _mm_cvtsi32_si128(old)));
+    std::memcpy(coverage + i, &merged, sizeof(merged));
+  }
+  AccumulateScalar(accum + i, coverage + i, count - i, _mm_cvtss_f32(carry));
+}
+
+__attribute__((target("avx2")))
+void AccumulateAvx2(const float* accum, uint8_t* coverage, size_t count) {
+  const auto sign = _mm256_set1_ps(-0.f);
+  const auto one = _mm256_set1_ps(1.f);
+  auto carry = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    auto x = _mm256_loadu_ps(accum + i);
+    x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+    x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+    // Propagate the low lane total into the high lane.
+    auto low = _mm256_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+    x = _mm256_add_ps(x, _mm256_permute2f128_ps(low, low, 0x08));
+    x = _mm256_add_ps(x, carry);
+    carry = _mm256_permutevar8x32_ps(x, _mm256_set1_epi32(7));
+    auto y = _mm256_andnot_ps(sign, x);
+    y = _mm256_sub_ps(y, _mm256_mul_ps(_mm256_floor_ps(_mm256_mul_ps(y, _mm256_set1_ps(.5f))), _mm256_set1_ps(2.f)));
+    y = _mm256_sub_ps(one, _mm256_andnot_ps(sign, _mm256_sub_ps(one, y)));
+    auto v = _mm256_cvtps_epi32(_mm256_mul_ps(y, _mm256_set1_ps(255.f)));
+    auto packed = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    packed = _mm_packus_epi16(packed, packed);
+    auto old = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(coverage + i));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(coverage + i), _mm_max_epu8(packed, old));
+  }
+  AccumulateScalar(accum + i, coverage + i, count - i, _mm256_cvtss_f32(carry));
+}
+
+#endif  // LAPS2_RASTER_X86
+
+std::vector<raster::Kernel> ProbeKernels() {
+  std::vector<raster::Kernel> result;
+#ifdef LAPS2_RASTER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) result.push_back({"avx2", AccumulateAvx2});
+  if (__builtin_cpu_supports("sse2")) result.push_back({"sse2", AccumulateSse2});
+#endif
+  result.push_back({"scalar", AccumulateScalar});
+  return result;
+}
+
+}  // namespace
+
+namespace raster {
+
+const Kernel& GetKernel() {
+  static const auto kernels = ProbeKernels();
+  return kernels.front();
+}
+
+std::vector<Kernel> GetKernels() {
+  return ProbeKernels();
+}
+
+Rasterizer::Rasterizer(const Kernel& kernel) :
+    kernel_(kernel), width_(0), height_(0) {}
+
+// Adds signed area of a line to the cells it crosses, after font-rs by Raph Levien.
+void Rasterizer::Line(float x0, float y0, float x1, float y1) {
+  if (std::fabs(y0 - y1) <= 1e-6f) return;
+  auto dir = 1.f;
+  if (y0 > y1) {
+    std::swap(x0, x1);
+    std::swap(y0, y1);
+    dir = -1.f;
+  }
+  auto dxdy = (x1 - x0) / (y1 - y0);
+  auto x = x0;
+  auto last = std::min(height_, static_cast<int>(std::ceil(y1)));
+  for (auto y = std::max(0, static_cast<int>(y0)); y < last; ++y) {
+    auto row = accum_.data() + y * width_;
+    auto dy = std::min(y + 1.f, y1) - std::max(static_cast<float>(y), y0);
+    auto xnext = x + dxdy * dy;
+    auto d = dy * dir;
+    auto left = std::max(0.f, std::min(x, xnext));
+    auto right = std::max(0.f, std::max(x, xnext));
+    auto left_floor = std::floor(left);
+    auto left_cell = static_cast<int>(left_floor);
+    auto right_ceil = std::ceil(right);
+    auto right_cell = static_cast<int>(right_ceil);
+    if (right_cell <= left_cell + 1) {
+      auto xmf = .5f * (x + xnext) - left_floor;
+      row[left_cell] += d - d * xmf;
+      row[left_cell + 1] += d * xmf;
+    } else {
+      auto s = 1.f / (right - left);
+      auto left_frac = left - left_floor;
+      auto a0 = .5f * s * (1.f - left_frac) * (1.f - left_frac);
+      auto right_frac = right - right_ceil + 1.f;
+      auto am = .5f * s * right_frac * right_frac;
+      row[left_cell] += d * a0;
+      if (right_cell == left_cell + 2) {
+        row[left_cell + 1] += d * (1.f - a0 - am);
+      } else {
+        auto a1 = s * (1.5f - left_frac);
+        row[left_cell + 1] += d * (a1 - a0);
+        for (auto xi = left_cell + 2; xi < right_cell - 1; ++xi)
+          row[xi] += d * s;
+        auto a2 = a1 + (right_cell - left_cell - 3) * s;
+        row[right_cell - 1] += d * (1.f - a2 - am);
+      }
+      row[right_cell] += d * am;
+    }
+    x = xnext;
+  }
+}
+
+void Rasterizer::Render(const Icon& icon, int width, int height, uint8_t* coverage) {
+  size_t count = width * height;
+  width_ = width;
+  height_ = height;
+  // Cells right of the last column spill into the next row, which the prefix sum relies on.
+  accum_.resize(count + width + 2);
+  std::fill(coverage, coverage + count, 0);
+  for (size_t i = 0; i < icon.count; ++i) {
+    std::fill(accum_.begin(), accum_.end(), 0.f);
+    const auto& polygon = *icon.polygons[i];
+    auto prev = polygon.points + polygon.count * 2 - 2;
+    for (auto ptr = polygon.points; ptr != polygon.points + polygon.count * 2; prev = ptr, ptr += 2)
+      Line(width * prev[0] / 256.f, height * prev[1] / 256.f, width * ptr[0] / 256.f, height * ptr[1] / 256.f);
+    kernel_.accumulate(accum_.data(), coverage, count);
+  }
+}
+
+}  // namespace raster
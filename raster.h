@@ -0,0 +1,40 @@
+#ifndef LAPS2_RASTER_H_
+#define LAPS2_RASTER_H_
+
+#include "icon.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace raster {
+
+struct Kernel {
+  const char* name;
+  // Prefix sums the accumulation buffer and merges the resulting coverage into the output.
+  void (*accumulate)(const float* accum, uint8_t* coverage, size_t count);
+};
+
+// Fastest kernel supported by the running cpu, and all of the supported ones.
+const Kernel& GetKernel();
+std::vector<Kernel> GetKernels();
+
+// Anti-aliased scanline rasterizer for icons.
+// Polygons are filled with the even-odd rule and combined like separate fill_poly requests.
+class Rasterizer {
+ private:
+  Kernel kernel_;
+  int width_;
+  int height_;
+  std::vector<float> accum_;
+
+  void Line(float x0, float y0, float x1, float y1);
+
+ public:
+  Rasterizer(const Kernel& kernel = GetKernel());
+  // Writes width * height bytes of coverage into the output buffer.
+  void Render(const Icon& icon, int width, int height, uint8_t* coverage);
+};
+
+}  // namespace raster
+
+#endif  // LAPS2_RASTER_H_
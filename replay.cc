@@ -0,0 +1,225 @@
+#include "replay.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// File starts with the magic and the time from process start to the recorder's creation, followed
+// by tagged records. Integers are LEB128 varints, names are defined once and referenced by id
+// afterwards, input times are deltas in nanoseconds.
+//   kDefine: id, length, bytes
+//   kInput: delta, widget id, key id, length, bytes
+
+namespace {
+
+const char kMagic[] = "LAPS2RC2";
+
+// Inputs recorded this close to each other, e.g. the properties of one uevent, are a batch.
+const int64_t kBatchWindow = 1000000;
+
+enum Tag : uint8_t {
+  kDefine = 0,
+  kInput
+};
+
+int64_t Now() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+// Origin of recorded and replayed times alike.
+const int64_t kSessionStart = Now();
+
+// Players with inputs left, they may live on workers.
+std::atomic<int> playing(0);
+
+void PutVarint(std::string& out, uint64_t value) {
+  for (; value >= 0x80; value >>= 7)
+    out.push_back(static_cast<char>(value | 0x80));
+  out.push_back(static_cast<char>(value));
+}
+
+void PutString(std::string& out, const char* data, size_t size) {
+  PutVarint(out, size);
+  out.append(data, size);
+}
+
+class Reader {
+ private:
+  const std::string& data_;
+  size_t offset_;
+
+ public:
+  Reader(const std::string& data) :
+      data_(data), offset_(0) {}
+
+  bool IsEmpty() const {
+    return offset_ == data_.size();
+  }
+
+  uint64_t GetVarint() {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (offset_ == data_.size()) throw std::runtime_error("Truncated varint");
+      auto byte = static_cast<uint8_t>(data_[offset_++]);
+      result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return result;
+    }
+    throw std::runtime_error("Malformed varint");
+  }
+
+  std::string GetString() {
+    auto size = GetVarint();
+    if (size > data_.size() - offset_) throw std::runtime_error("Truncated string");
+    auto result = data_.substr(offset_, size);
+    offset_ += size;
+    return result;
+  }
+};
+
+class Recorder {
+ private:
+  std::mutex mutex_;
+  std::ofstream out_;
+  std::unordered_map<std::string, uint64_t> names_;
+  int64_t last_;
+
+  uint64_t Intern(std::string& out, const char* name) {
+    auto it = names_.find(name);
+    if (it != names_.end()) return it->second;
+    auto id = names_.size();
+    names_.emplace(name, id);
+    out.push_back(kDefine);
+    PutVarint(out, id);
+    PutString(out, name, std::strlen(name));
+    return id;
+  }
+
+ public:
+  Recorder() :
+      last_(Now()) {
+    auto path = std::getenv("LAPS2_RECORD");
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!out_) throw std::runtime_error(std::string("Failed to open ") + path);
+    std::string header(kMagic, sizeof(kMagic) - 1);
+    PutVarint(header, last_ - kSessionStart);
+    out_.write(header.data(), header.size());
+  }
+
+  // Flushed per input, so a killed process leaves a usable trace behind.
+  void Record(const char* widget, const char* key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string record;
+    auto widget_id = Intern(record, widget);
+    auto key_id = Intern(record, key);
+    auto now = Now();
+    record.push_back(kInput);
+    PutVarint(record, now - last_);
+    PutVarint(record, widget_id);
+    PutVarint(record, key_id);
+    PutString(record, value.data(), value.size());
+    last_ = now;
+    out_.write(record.data(), record.size());
+    out_.flush();
+    if (!out_) throw std::runtime_error("Failed to write input record");
+  }
+};
+
+}  // namespace
+
+namespace replay {
+
+const bool kRecording = std::getenv("LAPS2_RECORD") != nullptr;
+const bool kReplaying = std::getenv("LAPS2_REPLAY") != nullptr;
+
+void Record(const char* widget, const char* key, const std::string& value) {
+  static Recorder recorder;
+  recorder.Record(widget, key, value);
+}
+
+bool IsPlaying() {
+  return playing.load(std::memory_order_relaxed) > 0;
+}
+
+Player::Player(const char* widget) :
+    next_(0),
+    fast_(std::getenv("LAPS2_REPLAY_FAST") != nullptr),
+    fd_(-1) {
+  auto path = std::getenv("LAPS2_REPLAY");
+  if (!path) throw std::runtime_error("No replay file given");
+  try {
+    auto data = util::ReadFile(path);
+    if (data.compare(0, sizeof(kMagic) - 1, kMagic)) throw std::runtime_error("Not an input trace");
+    data.erase(0, sizeof(kMagic) - 1);
+    Reader reader(data);
+    std::vector<std::string> names;
+    int64_t time = reader.GetVarint();
+    while (!reader.IsEmpty()) {
+      auto tag = reader.GetVarint();
+      if (tag == kDefine) {
+        if (reader.GetVarint() != names.size()) throw std::runtime_error("Unordered name definition");
+        names.push_back(reader.GetString());
+        continue;
+      }
+      if (tag != kInput) throw std::runtime_error("Unknown record");
+      time += reader.GetVarint();
+      auto widget_id = reader.GetVarint();
+      auto key_id = reader.GetVarint();
+      auto value = reader.GetString();
+      if (widget_id >= names.size() || key_id >= names.size()) throw std::runtime_error("Undefined name");
+      if (names[widget_id] == widget) inputs_.push_back({time, names[key_id], std::move(value)});
+    }
+  } catch (const std::exception&) {
+    std::throw_with_nested(std::runtime_error(std::string("Failed to load inputs from ") + path));
+  }
+  fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd_ < 0) util::ThrowSystemError("Failed to create replay timer");
+  Arm();
+  if (!inputs_.empty()) playing.fetch_add(1, std::memory_order_relaxed);
+}
+
+Player::~Player() {
+  if (next_ < inputs_.size()) playing.fetch_sub(1, std::memory_order_relaxed);
+  close(fd_);
+}
+
+int Player::GetFd() const {
+  return fd_;
+}
+
+// Fast replay arms the shortest possible timeout, so frames still get a chance in between.
+void Player::Arm() {
+  if (next_ == inputs_.size()) return;
+  auto deadline = fast_ ? Now() + 1 : kSessionStart + inputs_[next_].time;
+  itimerspec spec = {{0, 0}, {static_cast<time_t>(deadline / 1000000000), static_cast<long>(deadline % 1000000000)}};
+  if (timerfd_settime(fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    util::ThrowSystemError("Failed to arm replay timer");
+}
+
+bool Player::Play(const Apply& apply) {
+  uint64_t expirations;
+  auto expired = read(fd_, &expirations, sizeof(expirations)) == sizeof(expirations);
+  if (!expired && errno != EAGAIN) util::ThrowSystemError("Failed to read replay timer");
+  auto now = Now();
+  // The next batch is due once the timer expired, fast replay starts with the first one.
+  auto due = expired || (fast_ && !next_);
+  auto batch = next_ < inputs_.size() ? inputs_[next_].time + kBatchWindow : 0;
+  // Advanced before applying, so nested calls from within apply never see an input twice.
+  while (next_ < inputs_.size()) {
+    const auto& input = inputs_[next_];
+    if ((!due || input.time > batch) && (fast_ || kSessionStart + input.time > now)) break;
+    if (++next_ == inputs_.size()) playing.fetch_sub(1, std::memory_order_relaxed);
+    apply(input.key, input.value);
+  }
+  Arm();
+  return next_ < inputs_.size();
+}
+
+}  // namespace replay
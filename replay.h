@@ -0,0 +1,54 @@
+#ifndef LAPS2_REPLAY_H_
+#define LAPS2_REPLAY_H_
+
+#include "util.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Record and replay of raw widget inputs. LAPS2_RECORD names a file every input is appended to,
+// LAPS2_REPLAY names one whose inputs replace the real backends. Replay runs at recorded speed
+// unless LAPS2_REPLAY_FAST is set, then inputs are fed one batch per reactor iteration. Times are
+// relative to the start of the process, so every widget replays on the same timeline.
+namespace replay {
+
+// Checked before building a value, so disabled recording costs a load and a branch.
+extern const bool kRecording;
+extern const bool kReplaying;
+
+void Record(const char* widget, const char* key, const std::string& value);
+// True while any player still has inputs to deliver.
+bool IsPlaying();
+
+// Inputs of a single widget, delivered through a timer descriptor.
+class Player : public util::NonCopyable {
+ public:
+  using Apply = std::function<void(const std::string& key, const std::string& value)>;
+
+ private:
+  struct Input {
+    int64_t time;
+    std::string key;
+    std::string value;
+  };
+
+  std::vector<Input> inputs_;
+  size_t next_;
+  bool fast_;
+  int fd_;
+
+  void Arm();
+
+ public:
+  Player(const char* widget);
+  ~Player();
+  int GetFd() const;
+  // Applies inputs that are due, returns false once all of them were played. Can be called
+  // right after construction to apply inputs already due, fast replay applies the first batch.
+  bool Play(const Apply& apply);
+};
+
+}  // namespace replay
+
+#endif  // LAPS2_REPLAY_H_
@@ -0,0 +1,129 @@
+#include "../icon.h"
+#include "../util.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+// Compiles icon sources into resources.h declaring every icon and resources.cc defining them, so
+// each icon exists once however many translation units use it. Every polygon is validated,
+// identical polygons are emitted once and shared by all icons using them.
+//   rescomp output.h output.cc icon.bin...
+
+namespace {
+
+struct Resource {
+  std::string name;
+  std::vector<size_t> polygons;
+  size_t max_points;
+};
+
+// Unique polygons in order of first use, icons refer to them by index.
+using Polygons = std::vector<const std::vector<uint8_t>*>;
+
+std::string GetName(const std::string& path) {
+  auto begin = path.find_last_of('/');
+  begin = begin == std::string::npos ? 0 : begin + 1;
+  auto end = path.find_last_of('.');
+  if (end == std::string::npos || end < begin) end = path.size();
+  auto result = path.substr(begin, end - begin);
+  if (result.empty() || std::isdigit(result.front()) ||
+      !std::all_of(result.begin(), result.end(), [](char op) { return std::isalnum(op) || op == '_'; }))
+    throw std::runtime_error("Invalid identifier \"" + result + "\"");
+  return result;
+}
+
+void Write(const char* path, const std::string& data) {
+  std::ofstream file(path);
+  file << data;
+  if (!file) throw std::runtime_error(std::string("Failed to write ") + path);
+}
+
+std::string WriteHeader(const std::vector<Resource>& resources) {
+  std::ostringstream out;
+  out << "#ifndef LAPS2_RESOURCES_H_\n#define LAPS2_RESOURCES_H_\n\n";
+  out << "#include \"icon.h\"\n\n";
+  out << "// Generated by resources/rescomp, defined in resources.cc. The definitions are constant\n"
+      << "// initialized, other translation units may copy them during their own initialization.\n\n";
+  for (const auto& it : resources)
+    out << "extern const Icon " << it.name << ";\n";
+  out << "\nextern const Icon* const kIcons[" << resources.size() << "];\n\n";
+  out << "#endif  // LAPS2_RESOURCES_H_\n";
+  return out.str();
+}
+
+std::string WriteSource(const std::vector<Resource>& resources, const Polygons& polygons, size_t total) {
+  std::ostringstream out;
+  out << "#include \"resources.h\"\n\n";
+  out << "// Generated by resources/rescomp, " << polygons.size() << " unique of " << total << " polygons.\n\n";
+  out << "namespace {\n\n";
+  out << "const uint8_t kIconPoints[] = {";
+  std::vector<size_t> offsets;
+  size_t offset = 0;
+  for (auto it : polygons) {
+    offsets.push_back(offset);
+    out << "\n ";
+    for (auto coord : *it)
+      out << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(coord) << ",";
+    out << std::dec;
+    offset += it->size();
+  }
+  out << "\n};\n\n";
+  out << "const IconPolygon kIconPolygons[] = {\n";
+  for (size_t i = 0; i < polygons.size(); ++i)
+    out << "  {kIconPoints + " << offsets[i] << ", " << polygons[i]->size() / 2 << "},\n";
+  out << "};\n\n";
+  for (const auto& it : resources) {
+    out << "const IconPolygon* const " << it.name << "_polygons[] = {";
+    for (size_t i = 0; i < it.polygons.size(); ++i)
+      out << (i ? ", " : "") << "kIconPolygons + " << it.polygons[i];
+    out << "};\n";
+  }
+  out << "\n}  // namespace\n\n";
+  for (const auto& it : resources) {
+    out << "const Icon " << it.name << " = {" << it.name << "_polygons, " << it.polygons.size() << ", "
+        << it.max_points << ", nullptr};\n";
+  }
+  out << "\nconst Icon* const kIcons[" << resources.size() << "] = {\n";
+  for (const auto& it : resources)
+    out << "  &" << it.name << ",\n";
+  out << "};\n";
+  return out.str();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  try {
+    if (argc < 4) throw std::runtime_error("Usage: rescomp output.h output.cc icon.bin...");
+    std::vector<Resource> resources;
+    Polygons polygons;
+    std::map<std::vector<uint8_t>, size_t> index;
+    size_t total = 0;
+    for (int i = 3; i < argc; ++i) {
+      try {
+        Resource resource = {GetName(argv[i]), {}, 0};
+        for (auto& it : icon::Parse(util::ReadFile(argv[i]))) {
+          resource.max_points = std::max(resource.max_points, it.size() / 2);
+          auto inserted = index.emplace(std::move(it), polygons.size());
+          if (inserted.second) polygons.push_back(&inserted.first->first);
+          resource.polygons.push_back(inserted.first->second);
+          ++total;
+        }
+        resources.push_back(std::move(resource));
+      } catch (const std::exception&) {
+        std::throw_with_nested(std::runtime_error(std::string("Failed to compile ") + argv[i]));
+      }
+    }
+    Write(argv[1], WriteHeader(resources));
+    Write(argv[2], WriteSource(resources, polygons, total));
+    return 0;
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+    return 1;
+  }
+}
@@ -0,0 +1,170 @@
+#include "sample.h"
+#include "dbus.h"
+#include <algorithm>
+#include <ctime>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+
+const char kLogindDest[] = "org.freedesktop.login1";
+const char kLogindPath[] = "/org/freedesktop/login1";
+const char kLogindManagerIface[] = "org.freedesktop.login1.Manager";
+const char kLogindSessionIface[] = "org.freedesktop.login1.Session";
+const char kDBusPropIface[] = "org.freedesktop.DBus.Properties";
+
+uint64_t Now() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+uint64_t Align(uint64_t time, uint64_t slack) {
+  if (!slack) return time;
+  return (time + slack - 1) / slack * slack;
+}
+
+}  // namespace
+
+namespace sample {
+
+void SampledWidget::Tick() {
+  if (Sample()) Notify();
+}
+
+// The first sample is part of Init, the state is fetched once the icon is embedded.
+void SampledWidget::Start(int interval_ms, int slack_ms) {
+  Sample();
+  Scheduler::Get().Add(this, interval_ms, slack_ms);
+}
+
+void SampledWidget::Stop() {
+  Scheduler::Get().Remove(this);
+}
+
+Scheduler::Scheduler() :
+    reactor_(nullptr),
+    fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+    armed_(0),
+    idle_(false),
+    watching_(false),
+    subscription_(0) {
+  if (fd_ < 0) util::ThrowSystemError("Failed to create sampling timer");
+}
+
+Scheduler::~Scheduler() {
+  close(fd_);
+}
+
+void Scheduler::Bind(event::Reactor* reactor) {
+  if (reactor_) reactor_->Remove(fd_);
+  if (subscription_) dbus::Bus::Get().Unsubscribe(subscription_);
+  subscription_ = 0;
+  watching_ = false;
+  reactor_ = reactor;
+  if (!reactor_) return;
+  reactor_->Add(fd_, POLLIN, this);
+  if (!entries_.empty()) WatchIdle();
+}
+
+// Only the earliest deadline of a widget that is sampled at all arms the timer.
+void Scheduler::Arm() {
+  uint64_t deadline = 0;
+  for (const auto& it : entries_) {
+    if (!it.visible || idle_) continue;
+    if (!deadline || it.deadline < deadline) deadline = it.deadline;
+  }
+  if (deadline == armed_) return;
+  itimerspec spec = {{0, 0}, {static_cast<time_t>(deadline / 1000000000), static_cast<long>(deadline % 1000000000)}};
+  if (timerfd_settime(fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    util::ThrowSystemError("Failed to arm sampling timer");
+  armed_ = deadline;
+}
+
+// Sessions without logind are never considered idle, processes outside of a session get an error
+// reply that is not worth reporting.
+void Scheduler::WatchIdle() {
+  if (watching_) return;
+  watching_ = true;
+  try {
+    dbus::Message request(dbus_message_new_method_call(kLogindDest, kLogindPath, kLogindManagerIface,
+                                                       "GetSessionByPID"));
+    dbus_uint32_t pid = getpid();
+    dbus_message_append_args(request, DBUS_TYPE_UINT32, &pid, DBUS_TYPE_INVALID);
+    dbus::RequestAsync(dbus::Bus::Get().GetConnection(), request, [this](dbus::Message&& reply) {
+      if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) return;
+      dbus::StringView path;
+      dbus::Decode(reply, path);
+      if (!watching_) return;
+      session_.assign(path.data, path.size);
+      subscription_ = dbus::Bus::Get().Subscribe(session_, kDBusPropIface, "PropertiesChanged",
+                                                 [this](DBusMessage* message) {
+        dbus::StringView iface;
+        dbus::Dict<dbus::StringView, dbus::Variant> changed;
+        dbus::Decode(message, iface, changed);
+        changed.ForEach([this](const auto& key, const auto& value) {
+          if (key == "IdleHint") SetIdle(value.template Get<bool>());
+        });
+      });
+      const char* iface = kLogindSessionIface;
+      const char* property = "IdleHint";
+      dbus::Message get(dbus_message_new_method_call(kLogindDest, session_.c_str(), kDBusPropIface, "Get"));
+      dbus_message_append_args(get, DBUS_TYPE_STRING, &iface, DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+      dbus::RequestAsync(dbus::Bus::Get().GetConnection(), get, [this](dbus::Message&& reply) {
+        dbus::Variant value;
+        dbus::Decode(reply, value);
+        SetIdle(value.Get<bool>());
+      });
+    });
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+  }
+}
+
+void Scheduler::SetIdle(bool idle) {
+  idle_ = idle;
+  Arm();
+}
+
+void Scheduler::Add(SampledWidget* widget, int interval_ms, int slack_ms) {
+  uint64_t interval = std::max(interval_ms, 1) * 1000000ull;
+  uint64_t slack = std::max(slack_ms, 0) * 1000000ull;
+  entries_.push_back({widget, interval, slack, Align(Now() + interval, slack), true});
+  if (reactor_) WatchIdle();
+  Arm();
+}
+
+void Scheduler::Remove(const Widget* widget) {
+  entries_.erase(std::remove_if(entries_.begin(), entries_.end(), [widget](const auto& op) {
+    return op.widget == widget;
+  }), entries_.end());
+  Arm();
+}
+
+void Scheduler::SetVisible(const Widget* widget, bool visible) {
+  for (auto& it : entries_) {
+    if (it.widget == widget) it.visible = visible;
+  }
+  Arm();
+}
+
+// Deadlines missed while paused are due right away, every widget that is due shares the wakeup.
+void Scheduler::Handle(const pollfd&) {
+  uint64_t expirations;
+  if (read(fd_, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+  armed_ = 0;
+  auto now = Now();
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    auto& entry = entries_[i];
+    if (!entry.visible || idle_ || entry.deadline > now) continue;
+    entry.deadline = Align(now + entry.interval, entry.slack);
+    try {
+      entry.widget->Tick();
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+    }
+  }
+  Arm();
+}
+
+}  // namespace sample
@@ -0,0 +1,78 @@
+#ifndef LAPS2_SAMPLE_H_
+#define LAPS2_SAMPLE_H_
+
+#include "event.h"
+#include "util.h"
+#include "widget.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sample {
+
+class Scheduler;
+
+// Widget polled at an interval instead of woken up by events. Samples are taken on the main
+// thread by the shared scheduler, so they must not block.
+class SampledWidget : public Widget {
+ private:
+  friend class Scheduler;
+  void Tick();
+
+ protected:
+  // Reads the sources, returns true if the state changed.
+  virtual bool Sample() = 0;
+  // Samples right away and every interval after, each deadline may be delayed by up to slack to
+  // share a wakeup with other widgets.
+  void Start(int interval_ms, int slack_ms);
+  void Stop();
+
+ public:
+  void Handle(const pollfd&) override {}
+
+  bool MayBlock() final {
+    return false;
+  }
+};
+
+// Single timerfd on the main reactor for every sampled widget. Deadlines are rounded up to a
+// multiple of their slack, so widgets with similar intervals wake up together. Nothing is sampled
+// while the icon of a widget is unmapped or logind reports the session as idle.
+class Scheduler : public event::Handler, public util::Singleton<Scheduler> {
+ private:
+  struct Entry {
+    SampledWidget* widget;
+    uint64_t interval;
+    uint64_t slack;
+    uint64_t deadline;
+    bool visible;
+  };
+
+  event::Reactor* reactor_;
+  int fd_;
+  std::vector<Entry> entries_;
+  uint64_t armed_;
+  bool idle_;
+  bool watching_;
+  std::string session_;
+  unsigned long subscription_;
+
+  void Arm();
+  void WatchIdle();
+  void SetIdle(bool idle);
+
+ public:
+  Scheduler();
+  ~Scheduler();
+  // Sampling starts once bound, the idle hint is watched through the shared bus.
+  void Bind(event::Reactor* reactor);
+  void Add(SampledWidget* widget, int interval_ms, int slack_ms);
+  void Remove(const Widget* widget);
+  // Widgets are sampled right away when their icon becomes visible again.
+  void SetVisible(const Widget* widget, bool visible);
+  void Handle(const pollfd& fd) override;
+};
+
+}  // namespace sample
+
+#endif  // LAPS2_SAMPLE_H_
@@ -0,0 +1,69 @@
+#include "screen.h"
+#include <cstdlib>
+#include <memory>
+#include <xcb/dpms.h>
+#include <xcb/screensaver.h>
+
+namespace {
+
+// Power levels are reported with the state, which tells whether DPMS is enabled at all.
+bool PoweredDown(uint16_t power_level, bool enabled) {
+  return enabled && power_level != XCB_DPMS_DPMS_MODE_ON;
+}
+
+template<class T>
+using Reply = std::unique_ptr<T, decltype(&free)>;
+
+}  // namespace
+
+// Both extensions are set up in two round-trips, replies are only waited for once every request is
+// sent. DPMS only sends events from version 1.2 on, older servers usually start the screen saver
+// first anyway.
+ScreenMonitor::ScreenMonitor(xcb_connection_t* conn, xcb_window_t root) :
+    saver_event_(0), dpms_opcode_(0), saver_(false), dpms_(false) {
+  xcb_prefetch_extension_data(conn, &xcb_screensaver_id);
+  xcb_prefetch_extension_data(conn, &xcb_dpms_id);
+  auto saver = xcb_get_extension_data(conn, &xcb_screensaver_id);
+  auto dpms = xcb_get_extension_data(conn, &xcb_dpms_id);
+  xcb_screensaver_query_info_cookie_t saver_info = {0};
+  if (saver && saver->present) {
+    xcb_screensaver_select_input(conn, root, XCB_SCREENSAVER_EVENT_NOTIFY_MASK);
+    saver_event_ = saver->first_event + XCB_SCREENSAVER_NOTIFY;
+    saver_info = xcb_screensaver_query_info(conn, root);
+  }
+  xcb_dpms_get_version_cookie_t dpms_version = {0};
+  xcb_dpms_info_cookie_t dpms_info = {0};
+  if (dpms && dpms->present) {
+    dpms_version = xcb_dpms_get_version(conn, 1, 2);
+    dpms_info = xcb_dpms_info(conn);
+  }
+  if (saver_event_) {
+    Reply<xcb_screensaver_query_info_reply_t> reply(xcb_screensaver_query_info_reply(conn, saver_info, nullptr), &free);
+    saver_ = reply && reply->state == XCB_SCREENSAVER_STATE_ON;
+  }
+  if (!dpms || !dpms->present) return;
+  Reply<xcb_dpms_get_version_reply_t> version(xcb_dpms_get_version_reply(conn, dpms_version, nullptr), &free);
+  Reply<xcb_dpms_info_reply_t> info(xcb_dpms_info_reply(conn, dpms_info, nullptr), &free);
+  if (info) dpms_ = PoweredDown(info->power_level, info->state);
+  if (!version || (version->server_major_version == 1 && version->server_minor_version < 2)) return;
+  xcb_dpms_select_input(conn, XCB_DPMS_EVENT_MASK_INFO_NOTIFY);
+  dpms_opcode_ = dpms->major_opcode;
+}
+
+bool ScreenMonitor::Handle(const xcb_generic_event_t* evt) {
+  auto type = evt->response_type & ~0x80;
+  if (saver_event_ && type == saver_event_) {
+    saver_ = reinterpret_cast<const xcb_screensaver_notify_event_t*>(evt)->state == XCB_SCREENSAVER_STATE_ON;
+    return true;
+  }
+  if (!dpms_opcode_ || type != XCB_GE_GENERIC) return false;
+  auto generic = reinterpret_cast<const xcb_ge_generic_event_t*>(evt);
+  if (generic->extension != dpms_opcode_ || generic->event_type != XCB_DPMS_INFO_NOTIFY) return false;
+  auto info = reinterpret_cast<const xcb_dpms_info_notify_event_t*>(evt);
+  dpms_ = PoweredDown(info->power_level, info->state);
+  return true;
+}
+
+bool ScreenMonitor::IsBlanked() const {
+  return saver_ || dpms_;
+}
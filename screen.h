@@ -0,0 +1,24 @@
+#ifndef LAPS2_SCREEN_H_
+#define LAPS2_SCREEN_H_
+
+#include "util.h"
+#include <cstdint>
+#include <xcb/xcb.h>
+
+// Tracks whether the screen is blanked by the screen saver or powered down through DPMS, both
+// reported by events. Servers missing either extension never report that state as blanked.
+class ScreenMonitor : public util::NonCopyable {
+ private:
+  uint8_t saver_event_;
+  uint8_t dpms_opcode_;
+  bool saver_;
+  bool dpms_;
+
+ public:
+  ScreenMonitor(xcb_connection_t* conn, xcb_window_t root);
+  // Returns true if the event was one of the extension events.
+  bool Handle(const xcb_generic_event_t* evt);
+  bool IsBlanked() const;
+};
+
+#endif  // LAPS2_SCREEN_H_
@@ -0,0 +1,182 @@
+#include "shared.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+const uint64_t kMagic = 0x3253504153504c31ull;
+const char kPrefix[] = "/laps2-";
+// A writer killed in the middle of an update leaves the slot odd until it is restarted.
+const int kRetries = 64;
+// Subscribers never write the region, their threads notice a stop request after this long at most.
+const timespec kStopInterval = {1, 0};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word must be a plain integer");
+
+long Futex(std::atomic<uint32_t>& word, int op, uint32_t value, const timespec* timeout = nullptr) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), op, value, timeout, nullptr, 0);
+}
+
+// Identity of the running executable, builds differ in size or modification time at least.
+uint64_t GetBuild() {
+  struct stat info;
+  if (stat("/proc/self/exe", &info) < 0) util::ThrowSystemError("Can not stat executable");
+  uint64_t result = 0xcbf29ce484222325ull;
+  for (uint64_t it : {static_cast<uint64_t>(info.st_dev), static_cast<uint64_t>(info.st_ino),
+                      static_cast<uint64_t>(info.st_size), static_cast<uint64_t>(info.st_mtim.tv_sec),
+                      static_cast<uint64_t>(info.st_mtim.tv_nsec)})
+    result = (result ^ it) * 0x100000001b3ull;
+  return result;
+}
+
+shared::Region* Map(const std::string& name, int flags) {
+  auto path = kPrefix + name;
+  auto fd = shm_open(path.c_str(), flags | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) util::ThrowSystemError("Can not open shared region " + path);
+  struct stat info;
+  if ((flags & O_CREAT) && ftruncate(fd, sizeof(shared::Region)) < 0) {
+    close(fd);
+    util::ThrowSystemError("Can not resize shared region " + path);
+  }
+  if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) < sizeof(shared::Region)) {
+    close(fd);
+    throw std::runtime_error("Shared region " + path + " is incomplete");
+  }
+  auto result = mmap(nullptr, sizeof(shared::Region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (result == MAP_FAILED) util::ThrowSystemError("Can not map shared region " + path);
+  return static_cast<shared::Region*>(result);
+}
+
+}  // namespace
+
+namespace shared {
+
+// Regions left behind by a previous collector are reused, renderers still mapping them see the
+// slots being added again.
+Publisher::Publisher(const std::string& name) :
+    name_(kPrefix + name),
+    region_(Map(name, O_CREAT)) {
+  if (region_->magic != kMagic) new (region_) Region();
+  region_->magic = kMagic;
+  region_->build = GetBuild();
+  region_->count.store(0, std::memory_order_release);
+  for (auto& it : region_->slots)
+    it.sequence.store(it.sequence.load(std::memory_order_relaxed) & ~1u, std::memory_order_relaxed);
+  region_->generation.fetch_add(1, std::memory_order_release);
+  Futex(region_->generation, FUTEX_WAKE, INT_MAX);
+}
+
+Publisher::~Publisher() {
+  munmap(region_, sizeof(Region));
+  shm_unlink(name_.c_str());
+}
+
+size_t Publisher::Add(const char* name) {
+  auto result = region_->count.load(std::memory_order_relaxed);
+  if (result >= kMaxWidgets) throw std::runtime_error("Too many widgets for the shared region");
+  auto& slot = region_->slots[result];
+  std::strncpy(slot.name, name, kMaxName - 1);
+  slot.name[kMaxName - 1] = 0;
+  slot.icon.store(0, std::memory_order_relaxed);
+  slot.level.store(0, std::memory_order_relaxed);
+  region_->count.store(result + 1, std::memory_order_release);
+  return result;
+}
+
+void Publisher::Publish(size_t index, const IconState& state) {
+  auto& slot = region_->slots[index];
+  auto icon = icon::GetId(state.icon);
+  if (slot.icon.load(std::memory_order_relaxed) == icon && slot.level.load(std::memory_order_relaxed) == state.level)
+    return;
+  auto sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.icon.store(icon, std::memory_order_relaxed);
+  slot.level.store(state.level, std::memory_order_relaxed);
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+  region_->generation.fetch_add(1, std::memory_order_release);
+  Futex(region_->generation, FUTEX_WAKE, INT_MAX);
+}
+
+Subscriber::Subscriber(const std::string& name) :
+    region_(Map(name, 0)),
+    fd_(eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC)),
+    running_(true) {
+  if (fd_ < 0) {
+    munmap(region_, sizeof(Region));
+    util::ThrowSystemError("Failed to create subscriber eventfd");
+  }
+  if (region_->magic != kMagic || region_->build != GetBuild()) {
+    close(fd_);
+    munmap(region_, sizeof(Region));
+    throw std::runtime_error("Shared region " + name + " was not created by this build");
+  }
+  thread_ = std::thread(&Subscriber::Run, this, region_->generation.load(std::memory_order_acquire));
+}
+
+// Waking the futex would wake every other renderer as well, the thread stops on its next timeout.
+Subscriber::~Subscriber() {
+  running_ = false;
+  thread_.join();
+  close(fd_);
+  munmap(region_, sizeof(Region));
+}
+
+// Wakeups that find the generation unchanged were timeouts or meant for other waiters.
+void Subscriber::Run(uint32_t seen) {
+  while (running_) {
+    Futex(region_->generation, FUTEX_WAIT, seen, &kStopInterval);
+    auto generation = region_->generation.load(std::memory_order_acquire);
+    if (generation == seen) continue;
+    seen = generation;
+    uint64_t counter = 1;
+    if (write(fd_, &counter, sizeof(counter)) < 0) return;
+  }
+}
+
+int Subscriber::GetFd() const {
+  return fd_;
+}
+
+void Subscriber::Acknowledge() {
+  uint64_t counter;
+  if (read(fd_, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+    util::ThrowSystemError("Failed to read subscriber eventfd");
+}
+
+size_t Subscriber::GetCount() const {
+  return std::min<size_t>(region_->count.load(std::memory_order_acquire), kMaxWidgets);
+}
+
+const char* Subscriber::GetName(size_t slot) const {
+  return region_->slots[slot].name;
+}
+
+IconState Subscriber::Read(size_t index) const {
+  const auto& slot = region_->slots[index];
+  for (int retry = 0; retry < kRetries; ++retry) {
+    auto sequence = slot.sequence.load(std::memory_order_acquire);
+    auto icon = slot.icon.load(std::memory_order_relaxed);
+    auto level = slot.level.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(sequence & 1) && slot.sequence.load(std::memory_order_relaxed) == sequence)
+      return {icon::Find(icon), static_cast<uint8_t>(level)};
+    std::this_thread::yield();
+  }
+  throw std::runtime_error(std::string("Shared state of ") + slot.name + " is being written for too long");
+}
+
+}  // namespace shared
@@ -0,0 +1,80 @@
+#ifndef LAPS2_SHARED_H_
+#define LAPS2_SHARED_H_
+
+#include "icon.h"
+#include "util.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+// States of every widget in a shared memory region, published by a single collector running the
+// backends and read by renderers on any number of displays. LAPS2_COLLECT names the region a
+// process collects into, LAPS2_SHARED the one it renders from.
+namespace shared {
+
+const size_t kMaxWidgets = 16;
+const size_t kMaxName = 24;
+
+// Guarded by a seqlock, the sequence is odd while the collector writes. Names are written before
+// the slot count is raised and never change.
+struct Slot {
+  std::atomic<uint32_t> sequence;
+  std::atomic<uint32_t> icon;
+  std::atomic<uint32_t> level;
+  char name[kMaxName];
+};
+
+struct Region {
+  uint64_t magic;
+  // Icon ids are only meaningful to the same build.
+  uint64_t build;
+  std::atomic<uint32_t> count;
+  // Futex word, raised after every published change.
+  std::atomic<uint32_t> generation;
+  Slot slots[kMaxWidgets];
+};
+
+// Writer side, owned by the collector. Slots are added in widget order, so a restarted collector
+// keeps their positions.
+class Publisher : public util::NonCopyable {
+ private:
+  std::string name_;
+  Region* region_;
+
+ public:
+  Publisher(const std::string& name);
+  ~Publisher();
+  size_t Add(const char* name);
+  // Renderers are only woken up for actual changes.
+  void Publish(size_t slot, const IconState& state);
+};
+
+// Reader side. A thread sleeps on the futex word and signals an eventfd, so renderers wait for
+// changes in their reactor like for any other descriptor.
+class Subscriber : public util::NonCopyable {
+ private:
+  Region* region_;
+  int fd_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+
+  void Run(uint32_t seen);
+
+ public:
+  // Throws if no collector of the same build created the region.
+  Subscriber(const std::string& name);
+  ~Subscriber();
+  // Readable whenever the generation changed, including once right away.
+  int GetFd() const;
+  void Acknowledge();
+  size_t GetCount() const;
+  const char* GetName(size_t slot) const;
+  // Icon is nullptr until the backend of the slot is ready.
+  IconState Read(size_t slot) const;
+};
+
+}  // namespace shared
+
+#endif  // LAPS2_SHARED_H_
@@ -0,0 +1,247 @@
+#include "../history.h"
+#include "../pixmap.h"
+#include "../raster.h"
+#include "../resources.h"
+#include "../util.h"
+#include "../view.h"
+#include "../xcb.h"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <vector>
+
+namespace {
+
+const int kSizes[] = {16, 24, 32, 48, 64, 96, 128};
+const int kRounds = 100;
+const int kTrayWidgets = 8;
+
+// Counted by the replaced global operator new.
+unsigned long allocations = 0;
+
+// Everything written to descriptors by this process, the X connection is the only writer while
+// a benchmark runs.
+unsigned long BytesWritten() {
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  unsigned long value;
+  while (io >> key >> value) {
+    if (key == "wchar:") return value;
+  }
+  return 0;
+}
+
+template<class F, class G>
+double IconsPerSecond(F render, G finish) {
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < kRounds; ++round) {
+    for (auto icon : kIcons)
+      render(icon);
+  }
+  finish();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return kRounds * util::Length(kIcons) / elapsed.count();
+}
+
+void PrintRow(const std::string& name, const std::vector<double>& values, int precision = 0) {
+  std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(precision);
+  for (auto it : values)
+    std::cout << std::setw(10) << it;
+  std::cout << std::endl;
+}
+
+void BenchRaster() {
+  for (const auto& kernel : raster::GetKernels()) {
+    raster::Rasterizer rasterizer(kernel);
+    std::vector<uint8_t> coverage;
+    std::vector<double> row;
+    for (auto size : kSizes) {
+      coverage.resize(size * size);
+      row.push_back(IconsPerSecond([&](auto icon) {
+        rasterizer.Render(*icon, size, size, coverage.data());
+      }, [] {}));
+    }
+    PrintRow(std::string("raster/") + kernel.name, row);
+  }
+}
+
+// Sample and sparkline per frame, the cost must not depend on how many samples are kept.
+void BenchSparkline() {
+  for (size_t capacity : {1u << 10, 1u << 20}) {
+    history::Ring ring(capacity);
+    for (size_t i = 0; i < capacity; ++i)
+      ring.Push(static_cast<uint8_t>(i * 37));
+    history::Sparkline sparkline;
+    std::vector<double> row;
+    for (auto size : kSizes) {
+      row.push_back(IconsPerSecond([&](auto) {
+        ring.Push(static_cast<uint8_t>(ring.GetCount() * 37));
+        sparkline.Build(ring, size, size);
+      }, [] {}));
+    }
+    PrintRow("sparkline/" + std::to_string(capacity) + " samples", row);
+  }
+}
+
+// Cache of a single entry, every request renders and uploads the icon again.
+// Completions of shared memory uploads are read as the reactor would, without waiting for them.
+void BenchServer(xcb_connection_t* conn, PixmapCache::Backend backend) {
+  PixmapCache cache(conn, 1, backend);
+  auto drain = [conn, &cache] {
+    while (auto evt = xcb_poll_for_event(conn)) {
+      cache.Handle(evt);
+      free(evt);
+    }
+  };
+  std::vector<double> row;
+  for (auto size : kSizes) {
+    row.push_back(IconsPerSecond([&](auto icon) {
+      cache.Get({icon, 0}, size, size);
+      drain();
+    }, [conn, &drain] {
+      free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), nullptr));
+      drain();
+    }));
+  }
+  PrintRow(cache.GetBackendName(), row);
+}
+
+// Full frames through a view: new state, damage, repair and flush, like the frame scheduler does.
+void BenchView(const std::string& name, xcb_connection_t* conn,
+               const std::function<std::unique_ptr<Surface>(int size)>& factory) {
+  std::vector<double> rate, allocs, bytes;
+  for (auto size : kSizes) {
+    WidgetView view(name.c_str(), factory(size), size, size);
+    auto frames = static_cast<double>(kRounds * util::Length(kIcons));
+    auto allocations_before = allocations;
+    auto bytes_before = BytesWritten();
+    rate.push_back(IconsPerSecond([&](auto icon) {
+      view.SetState({icon, 0});
+      view.Damage(view.GetArea());
+      view.Repair();
+      if (conn) xcb_flush(conn);
+    }, [conn] {
+      if (conn) free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), nullptr));
+    }));
+    allocs.push_back((allocations - allocations_before) / frames);
+    bytes.push_back((BytesWritten() - bytes_before) / frames);
+  }
+  PrintRow(name + " icons/s", rate);
+  PrintRow(name + " allocs/frame", allocs, 2);
+  PrintRow(name + " bytes/frame", bytes, 1);
+}
+
+// Requests sent to the server since begin, not counting the no-op used to probe the sequence.
+unsigned Requests(xcb_connection_t* conn, unsigned begin) {
+  return xcb_no_operation(conn).sequence - begin - 1;
+}
+
+// Tray of several widgets, either a window per view or slots of a compositor. Frames change every
+// view or a single one, and are flushed once like the frame scheduler does.
+void BenchTray(const std::string& name, xcb_connection_t* conn, bool composite) {
+  std::vector<double> setup, all_requests, all_time, one_requests, one_time;
+  for (auto size : kSizes) {
+    PixmapCache cache(conn, util::Length(kIcons));
+    std::unique_ptr<Compositor> compositor;
+    std::vector<std::unique_ptr<WidgetView>> views;
+    auto begin = xcb_no_operation(conn).sequence;
+    if (composite) {
+      compositor = std::make_unique<Compositor>(conn, cache);
+      compositor->Resize(size, size);
+      for (int i = 0; i < kTrayWidgets; ++i)
+        views.push_back(compositor->Add("tray"));
+      for (auto& it : views)
+        it->Resize(compositor->GetSlotSize(), compositor->GetSlotSize());
+    } else {
+      for (int i = 0; i < kTrayWidgets; ++i)
+        views.push_back(std::make_unique<WidgetView>("tray", std::make_unique<PixmapSurface>(conn, cache, size, size),
+                                                     size, size));
+    }
+    setup.push_back(Requests(conn, begin));
+    auto frames = [&](size_t changed, std::vector<double>& requests, std::vector<double>& time) {
+      auto first = xcb_no_operation(conn).sequence;
+      auto start = std::chrono::steady_clock::now();
+      for (int round = 0; round < kRounds; ++round) {
+        for (size_t i = 0; i < changed; ++i) {
+          views[i]->SetState({kIcons[(round + i) % util::Length(kIcons)], 0});
+          views[i]->Damage(views[i]->GetArea());
+          views[i]->Repair();
+        }
+        xcb_flush(conn);
+      }
+      free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), nullptr));
+      std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+      // The round-trip closing the measurement is one more request.
+      requests.push_back((Requests(conn, first) - 1) / static_cast<double>(kRounds));
+      time.push_back(elapsed.count() / kRounds);
+    };
+    // Warm up the cache, so only copies are measured.
+    std::vector<double> warmup;
+    frames(views.size(), warmup, warmup);
+    frames(views.size(), all_requests, all_time);
+    frames(1, one_requests, one_time);
+    views.clear();
+  }
+  PrintRow(name + " requests/setup", setup);
+  PrintRow(name + " requests/frame all", all_requests, 1);
+  PrintRow(name + " us/frame all", all_time, 1);
+  PrintRow(name + " requests/frame one", one_requests, 1);
+  PrintRow(name + " us/frame one", one_time, 1);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++allocations;
+  if (auto result = std::malloc(size)) return result;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+int main() {
+  try {
+    std::cout << std::left << std::setw(32) << "icons/s" << std::right;
+    for (auto size : kSizes)
+      std::cout << std::setw(8) << size << "px";
+    std::cout << std::endl;
+    BenchRaster();
+    BenchSparkline();
+    BenchView("view/framebuffer", nullptr, [](int) {
+      return std::make_unique<FramebufferSurface>();
+    });
+    xcb::Connection conn(xcb_connect(nullptr, nullptr), &xcb_disconnect);
+    if (xcb_connection_has_error(conn.get())) {
+      std::cout << "No display, skipping server side backends" << std::endl;
+      return 0;
+    }
+    BenchServer(conn.get(), PixmapCache::kPolygons);
+    BenchServer(conn.get(), PixmapCache::kRaster);
+    BenchView("view/polygons", conn.get(), [&conn](int size) {
+      return std::make_unique<PolygonSurface>(conn.get(), size, size);
+    });
+    // Steady state of the application, every icon stays cached after the first round.
+    for (auto backend : {PixmapCache::kPolygons, PixmapCache::kRaster}) {
+      PixmapCache cache(conn.get(), util::Length(kIcons), backend);
+      BenchView(std::string("view/pixmap/") + cache.GetBackendName(), conn.get(), [&conn, &cache](int size) {
+        return std::make_unique<PixmapSurface>(conn.get(), cache, size, size);
+      });
+    }
+    BenchTray("tray/windows", conn.get(), false);
+    BenchTray("tray/composite", conn.get(), true);
+    return 0;
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+    return 1;
+  }
+}
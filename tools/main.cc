@@ -1,6 +1,6 @@
-#include "../widget.h"
-#include "../xcb.h"
 #include "../util.h"
+#include "../view.h"
+#include "../xcb.h"
 #include <iostream>
 #include <vector>
 #include <sys/inotify.h>
@@ -9,84 +9,16 @@
 
 namespace {
 
-void PrintException(const std::exception& ex) {
-  int level = 0;
-  util::UnwindNested(ex, [&level](const auto& ex) {
-    std::cout << "!" << std::string(level++ * 2 + 1, ' ') << ex.what() << std::endl;
-  });
-}
-
-class WidgetView {
- private:
-  int width_;
-  int height_;
-  const uint8_t* state_;
-  xcb_window_t window_;
-  xcb_gcontext_t context_;
-
-  xcb_window_t CreateWindow(xcb_connection_t* conn, int width, int height) {
-    auto result = xcb_generate_id(conn);
-    auto screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
-    uint32_t mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
-    uint32_t values[] = {screen->white_pixel, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_RESIZE_REDIRECT};
-    xcb_create_window(conn, XCB_COPY_FROM_PARENT, result, screen->root, 0, 0, width, height, 0,
-                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, mask, values);
-    return result;
-  }
-
-  xcb_gcontext_t CreateContext(xcb_connection_t* conn) {
-    auto result = xcb_generate_id(conn);
-    auto screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
-    uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
-    uint32_t values[] = {screen->black_pixel, 0};
-    xcb_create_gc(conn, result, screen->root, mask, values);
-    return result;
-  }
-
- public:
-  WidgetView(const WidgetView&) = delete;
-  WidgetView(WidgetView&&) = default;
-
-  WidgetView(xcb_connection_t* conn, int size) :
-      width_(size), height_(size),
-      state_(nullptr),
-      window_(CreateWindow(conn, width_, height_)),
-      context_(CreateContext(conn)) {
-    xcb_map_window(conn, window_);
-  }
-
-  void Update(xcb_connection_t* conn) {
-    if (width_ < 0 || height_ < 0 || !state_) return;
-    xcb_clear_area(conn, false, window_, 0, 0, width_, height_);
-    xcb_flush(conn);
-    for (auto ptr = state_; ptr[0] || ptr[1]; ptr += 2) {
-      std::vector<xcb_point_t> poly;
-      for (; ptr[0] || ptr[1]; ptr += 2)
-        poly.push_back({static_cast<int16_t>(width_ * ptr[0] >> 8), static_cast<int16_t>(height_ * ptr[1] >> 8)});
-      xcb_fill_poly(conn, window_, context_, XCB_POLY_SHAPE_NONCONVEX, XCB_COORD_MODE_ORIGIN, poly.size(), poly.data());
-    }
-  }
-
-  void Resize(int width, int height) {
-    width_ = width;
-    height_ = height;
-  }
-
-  void SetState(const uint8_t* state) {
-    state_ = state;
-  }
-};
-
 void HandleXcbEvent(xcb_connection_t* conn, xcb_generic_event_t* evt, WidgetView& view) {
   switch (evt->response_type & ~0x80) {
     case XCB_EXPOSE: {
-      view.Update(conn);
+      view.Update(view.GetArea());
       break;
     }
     case XCB_RESIZE_REQUEST: {
       auto req = reinterpret_cast<xcb_resize_request_event_t*>(evt);
       view.Resize(req->width, req->height);
-      view.Update(conn);
+      view.Update(view.GetArea());
       break;
     }
     default:
@@ -94,11 +26,21 @@ void HandleXcbEvent(xcb_connection_t* conn, xcb_generic_event_t* evt, WidgetView
   }
 }
 
+// The view moves on to the new icon before the previous one is released, so it never points to a
+// freed icon and a new one can not reuse its address while still referenced.
 void HandleWidgetEvent(xcb_connection_t* conn, const std::string& fname, WidgetView& view) {
-  static std::string buffer;
-  buffer = util::ReadFile(fname);
-  view.SetState(reinterpret_cast<const uint8_t*>(buffer.data()));
-  view.Update(conn);
+  static std::unique_ptr<icon::Holder> icon;
+  std::unique_ptr<icon::Holder> loaded;
+  try {
+    loaded = std::make_unique<icon::Holder>(util::ReadFile(fname));
+  } catch (const std::exception& ex) {
+    // Keep showing the last good version while the file is being edited.
+    util::PrintException(ex);
+    return;
+  }
+  view.SetState({loaded->Get(), 0});
+  icon = std::move(loaded);
+  view.Update(view.GetArea());
 }
 
 }  // namespace
@@ -107,7 +49,9 @@ int main(int argc, char** argv) {
   try {
     if (argc < 3) throw std::runtime_error("Invalid arguments");
     xcb::Connection conn(xcb_connect(nullptr, nullptr), &xcb_disconnect);
-    WidgetView view(conn.get(), std::atoi(argv[2]));
+    auto size = std::atoi(argv[2]);
+    WidgetView view("view", std::make_unique<PolygonSurface>(conn.get(), size, size), size, size);
+    xcb_map_window(conn.get(), view.GetSurface().GetWindow());
     HandleWidgetEvent(conn.get(), argv[1], view);
     int inotify_fd = inotify_init();
     if (inotify_fd < 0) throw std::runtime_error("Inotify initialization failed");
@@ -134,7 +78,7 @@ int main(int argc, char** argv) {
     }
     return 0;
   } catch (const std::exception& ex) {
-    PrintException(ex);
+    util::PrintException(ex);
     return 1;
   }
 }
@@ -0,0 +1,165 @@
+#include "trace.h"
+#include "util.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+const char* kPhaseNames[] = {"handle", "get_state", "update", "flush", "latency"};
+static_assert(sizeof(kPhaseNames) / sizeof(*kPhaseNames) == trace::kPhases, "Mismatching number of phase names");
+
+// Most recent spans kept for export, older ones are overwritten.
+const size_t kMaxEvents = 1 << 16;
+
+// Four buckets per power of two, percentiles are accurate within 19%.
+const int kSubBuckets = 4;
+const int kBuckets = 64 * kSubBuckets;
+
+int GetBucket(int64_t value) {
+  if (value < kSubBuckets) return std::max<int64_t>(value, 0);
+  auto log = 63 - __builtin_clzll(value);
+  auto sub = (value >> (log - 2)) & (kSubBuckets - 1);
+  return (log - 1) * kSubBuckets + sub;
+}
+
+int64_t GetBucketLimit(int bucket) {
+  if (bucket < kSubBuckets) return bucket;
+  auto log = bucket / kSubBuckets + 1;
+  auto sub = bucket % kSubBuckets;
+  return ((kSubBuckets + sub + 1) << (log - 2)) - 1;
+}
+
+struct Histogram {
+  uint64_t counts[kBuckets];
+  uint64_t total;
+  int64_t max;
+
+  void Add(int64_t value) {
+    ++counts[GetBucket(value)];
+    ++total;
+    max = std::max(max, value);
+  }
+
+  int64_t Percentile(double percent) const {
+    auto rank = static_cast<uint64_t>(total * percent / 100.);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (seen > rank) return std::min(GetBucketLimit(i), max);
+    }
+    return max;
+  }
+};
+
+struct Histograms {
+  Histogram phases[trace::kPhases];
+};
+
+struct Event {
+  const char* name;
+  trace::Phase phase;
+  long tid;
+  int64_t begin;
+  int64_t end;
+};
+
+struct Recorder {
+  std::mutex mutex;
+  std::map<std::string, Histograms, std::less<>> histograms;
+  std::vector<Event> events;
+  size_t next_event{0};
+};
+
+Recorder& GetRecorder() {
+  static Recorder recorder;
+  return recorder;
+}
+
+const char* GetExportPath() {
+  auto result = std::getenv("LAPS2_TRACE");
+  return result && std::strcmp(result, "1") ? result : nullptr;
+}
+
+thread_local int64_t wakeup = 0;
+
+}  // namespace
+
+namespace trace {
+
+const bool kEnabled = std::getenv("LAPS2_TRACE") != nullptr;
+
+int64_t Now() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+void SetWakeup(int64_t time) {
+  wakeup = time;
+}
+
+int64_t GetWakeup() {
+  return wakeup;
+}
+
+void Record(const char* name, Phase phase, int64_t begin, int64_t end) {
+  static thread_local auto tid = syscall(SYS_gettid);
+  auto& recorder = GetRecorder();
+  std::lock_guard<std::mutex> lock(recorder.mutex);
+  auto histograms = recorder.histograms.find(name);
+  if (histograms == recorder.histograms.end())
+    histograms = recorder.histograms.emplace(name, Histograms()).first;
+  histograms->second.phases[phase].Add(end - begin);
+  Event event = {name, phase, tid, begin, end};
+  if (recorder.events.size() < kMaxEvents) recorder.events.push_back(event);
+  else recorder.events[recorder.next_event] = event;
+  recorder.next_event = (recorder.next_event + 1) % kMaxEvents;
+}
+
+void Dump(std::ostream& out) {
+  auto& recorder = GetRecorder();
+  std::lock_guard<std::mutex> lock(recorder.mutex);
+  out << std::fixed << std::setprecision(3);
+  for (const auto& it : recorder.histograms) {
+    for (int phase = 0; phase < kPhases; ++phase) {
+      const auto& histogram = it.second.phases[phase];
+      if (!histogram.total) continue;
+      out << "trace: " << it.first << " " << kPhaseNames[phase] << " " << histogram.total << " samples, p50 "
+          << histogram.Percentile(50) / 1e6 << " ms, p99 " << histogram.Percentile(99) / 1e6 << " ms, max "
+          << histogram.max / 1e6 << " ms" << std::endl;
+    }
+  }
+  out.unsetf(std::ios::floatfield);
+}
+
+void Export() {
+  auto path = GetExportPath();
+  if (!path) return;
+  std::ofstream out(path);
+  if (!out) throw std::runtime_error(std::string("Failed to open ") + path);
+  auto& recorder = GetRecorder();
+  std::lock_guard<std::mutex> lock(recorder.mutex);
+  out << "{\"traceEvents\":[";
+  auto pid = getpid();
+  const char* separator = "\n";
+  for (const auto& it : recorder.events) {
+    out << separator << "{\"name\":\"" << kPhaseNames[it.phase] << "\",\"cat\":\"" << it.name
+        << "\",\"ph\":\"X\",\"ts\":" << it.begin / 1000 << "." << std::setfill('0') << std::setw(3) << it.begin % 1000
+        << ",\"dur\":" << (it.end - it.begin) / 1000 << "." << std::setw(3) << (it.end - it.begin) % 1000
+        << std::setfill(' ') << ",\"pid\":" << pid << ",\"tid\":" << it.tid << "}";
+    separator = ",\n";
+  }
+  out << "\n]}\n";
+  if (!out) throw std::runtime_error(std::string("Failed to write ") + path);
+}
+
+}  // namespace trace
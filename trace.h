@@ -0,0 +1,55 @@
+#ifndef LAPS2_TRACE_H_
+#define LAPS2_TRACE_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Latency tracing along the path from a source event to pixels on screen. Enabled by setting
+// LAPS2_TRACE, a value other than 1 names the file Chrome trace events are exported into.
+namespace trace {
+
+enum Phase {
+  kHandle = 0,  // Widget::Handle
+  kGetState,    // Widget::GetState
+  kUpdate,      // WidgetView::Update
+  kFlush,       // xcb_flush of a frame
+  kLatency,     // Poll wakeup of the source event until the frame showing it was flushed
+  kPhases
+};
+
+// Checked before every measurement, so disabled tracing costs a load and a branch.
+extern const bool kEnabled;
+
+// Monotonic nanoseconds.
+int64_t Now();
+
+// Last return from polling on the calling thread, the origin of whatever it handles next.
+void SetWakeup(int64_t time);
+int64_t GetWakeup();
+
+void Record(const char* name, Phase phase, int64_t begin, int64_t end);
+
+class Span {
+ private:
+  const char* name_;
+  Phase phase_;
+  int64_t begin_;
+
+ public:
+  Span(const char* name, Phase phase) :
+      name_(name), phase_(phase), begin_(kEnabled ? Now() : 0) {}
+
+  ~Span() {
+    if (kEnabled) Record(name_, phase_, begin_, Now());
+  }
+};
+
+// Prints p50, p99 and max of every phase for every name.
+void Dump(std::ostream& out);
+// Writes recorded spans in the Chrome trace event format, if an export file was configured.
+void Export();
+
+}  // namespace trace
+
+#endif  // LAPS2_TRACE_H_
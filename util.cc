@@ -1,7 +1,12 @@
 #include "util.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace {
 
@@ -18,6 +23,41 @@ void UnwindNested(const std::exception& ex, const std::function<void(const std::
 
 namespace util {
 
+PolledFile::PolledFile(const std::string& path, size_t capacity) :
+    path_(path),
+    fd_(open(path.c_str(), O_RDONLY | O_CLOEXEC)),
+    buffer_(std::max<size_t>(capacity, 2)) {
+  if (fd_ < 0) ThrowSystemError("Can not open " + path_);
+}
+
+PolledFile::~PolledFile() {
+  close(fd_);
+}
+
+// Sysfs and procfs regenerate the content on every read from offset 0, a full buffer means it
+// may have been cut off.
+const char* PolledFile::Read() {
+  ssize_t size;
+  for (;;) {
+    size = pread(fd_, buffer_.data(), buffer_.size() - 1, 0);
+    if (size < 0) ThrowSystemError("Can not read " + path_);
+    if (static_cast<size_t>(size) < buffer_.size() - 1) break;
+    buffer_.resize(buffer_.size() * 2);
+  }
+  if (size && buffer_[size - 1] == '\n') --size;
+  buffer_[size] = 0;
+  return buffer_.data();
+}
+
+long PolledFile::ReadLong() {
+  auto content = Read();
+  char* end;
+  errno = 0;
+  auto result = std::strtol(content, &end, 10);
+  if (end == content || *end || errno) throw std::runtime_error(path_ + " is not a number");
+  return result;
+}
+
 std::string ReadFile(const std::string& path) {
   std::ifstream source(path);
   if (!source.is_open()) ThrowSystemError("Can not read file");
@@ -3,6 +3,8 @@
 
 #include <functional>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace util {
 
@@ -36,6 +38,7 @@ class Holder : public NonCopyable {
 
   Holder(Holder&& op) {
     impl_ = op.impl_;
+    dtor_ = op.dtor_;
     op.impl_ = nullptr;
   }
 
@@ -50,6 +53,22 @@ constexpr int Length(const T(&)[N]) {
   return N;
 }
 
+// File kept open and read from the start every time, for sysfs attributes and procfs tables that
+// are polled. The buffer only grows while the content does, steady state reads allocate nothing.
+class PolledFile : public NonCopyable {
+ private:
+  std::string path_;
+  int fd_;
+  std::vector<char> buffer_;
+
+ public:
+  PolledFile(const std::string& path, size_t capacity = 64);
+  ~PolledFile();
+  // Content without the trailing newline, valid until the next read.
+  const char* Read();
+  long ReadLong();
+};
+
 std::string ReadFile(const std::string& path);
 void PrintException(const std::exception& ex);
 void ThrowSystemError(const std::string& what);
@@ -0,0 +1,283 @@
+#include "view.h"
+#include "trace.h"
+#include <algorithm>
+
+namespace {
+
+// Unmapped icon window, the tray's resize requests are redirected to us.
+xcb_window_t CreateWindow(xcb_connection_t* conn, int width, int height) {
+  auto result = xcb_generate_id(conn);
+  auto screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+  uint32_t window_mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
+  uint32_t window_values[] = {screen->white_pixel, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_RESIZE_REDIRECT |
+                              XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_VISIBILITY_CHANGE};
+  xcb_create_window(conn, XCB_COPY_FROM_PARENT, result, screen->root, 0, 0,
+                    std::max(width, 1), std::max(height, 1), 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                    XCB_COPY_FROM_PARENT, window_mask, window_values);
+  return result;
+}
+
+xcb_gcontext_t CreateContext(xcb_connection_t* conn) {
+  auto result = xcb_generate_id(conn);
+  auto screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+  uint32_t context_mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
+  uint32_t context_values[] = {screen->black_pixel, 0};
+  xcb_create_gc(conn, result, screen->root, context_mask, context_values);
+  return result;
+}
+
+}  // namespace
+
+WindowSurface::WindowSurface(xcb_connection_t* conn, int width, int height) :
+    conn_(conn),
+    window_(CreateWindow(conn, width, height)),
+    context_(CreateContext(conn)) {}
+
+WindowSurface::~WindowSurface() {
+  xcb_free_gc(conn_, context_);
+  xcb_destroy_window(conn_, window_);
+}
+
+xcb_window_t WindowSurface::GetWindow() const {
+  return window_;
+}
+
+PolygonSurface::PolygonSurface(xcb_connection_t* conn, int width, int height) :
+    WindowSurface(conn, width, height) {}
+
+void PolygonSurface::Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) {
+  xcb_clear_area(conn_, false, window_, area.x, area.y, area.width, area.height);
+  auto icon = instance_.Build(state, width, height);
+  if (points_.size() < icon->max_points) points_.resize(icon->max_points);
+  for (size_t i = 0; i < icon->count; ++i) {
+    const auto& polygon = *icon->polygons[i];
+    for (size_t j = 0; j < polygon.count; ++j) {
+      auto ptr = polygon.points + j * 2;
+      points_[j] = {static_cast<int16_t>(width * ptr[0] >> 8), static_cast<int16_t>(height * ptr[1] >> 8)};
+    }
+    xcb_fill_poly(conn_, window_, context_, XCB_POLY_SHAPE_NONCONVEX, XCB_COORD_MODE_ORIGIN,
+                  polygon.count, points_.data());
+  }
+}
+
+PixmapSurface::PixmapSurface(xcb_connection_t* conn, PixmapCache& cache, int width, int height) :
+    WindowSurface(conn, width, height), cache_(cache) {}
+
+void PixmapSurface::Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) {
+  auto pixmap = cache_.Get(state, width, height);
+  xcb_copy_area(conn_, pixmap, window_, context_, area.x, area.y, area.x, area.y, area.width, area.height);
+}
+
+void PixmapSurface::DrawTrend(const Icon& trend, int width, int height, const xcb_rectangle_t& area) {
+  auto pixmap = cache_.Draw(trend, width, height);
+  xcb_copy_area(conn_, pixmap, window_, context_, area.x, area.y, area.x, area.y, area.width, area.height);
+}
+
+SlotSurface::SlotSurface(xcb_connection_t* conn, PixmapCache& cache, xcb_window_t window, xcb_gcontext_t context) :
+    conn_(conn), cache_(cache), window_(window), context_(context), x_(0), y_(0) {}
+
+void SlotSurface::Move(int x, int y) {
+  x_ = static_cast<int16_t>(x);
+  y_ = static_cast<int16_t>(y);
+}
+
+void SlotSurface::Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) {
+  auto pixmap = cache_.Get(state, width, height);
+  xcb_copy_area(conn_, pixmap, window_, context_, area.x, area.y, x_ + area.x, y_ + area.y, area.width, area.height);
+}
+
+void SlotSurface::DrawTrend(const Icon& trend, int width, int height, const xcb_rectangle_t& area) {
+  auto pixmap = cache_.Draw(trend, width, height);
+  xcb_copy_area(conn_, pixmap, window_, context_, area.x, area.y, x_ + area.x, y_ + area.y, area.width, area.height);
+}
+
+void FramebufferSurface::Resize(int width, int height) {
+  pixels_.resize(std::max(width, 0) * std::max(height, 0));
+}
+
+// The rasterizer always produces the whole icon, damage is not worth clipping at icon sizes.
+void FramebufferSurface::Draw(const IconState& state, int width, int height, const xcb_rectangle_t&) {
+  rasterizer_.Render(*instance_.Build(state, width, height), width, height, pixels_.data());
+}
+
+const std::vector<uint8_t>& FramebufferSurface::GetPixels() const {
+  return pixels_;
+}
+
+WidgetView::WidgetView(const char* name, std::unique_ptr<Surface> surface, int width, int height) :
+    name_(name),
+    surface_(std::move(surface)),
+    width_(width), height_(height),
+    state_({nullptr, 0}),
+    bucket_(0),
+    history_(nullptr),
+    samples_(0),
+    origin_(0),
+    dirty_(false),
+    damage_({0, 0, 0, 0}),
+    hidden_(0) {
+  if (width_ > 0 && height_ > 0) surface_->Resize(width_, height_);
+}
+
+void WidgetView::Update(const xcb_rectangle_t& area) {
+  if (width_ <= 0 || height_ <= 0) return;
+  auto trend = history_ ? sparkline_.Build(*history_, width_, height_) : nullptr;
+  if (!trend && !state_.icon) return;
+  trace::Span span(name_, trace::kUpdate);
+  if (trend) surface_->DrawTrend(*trend, width_, height_, area);
+  else surface_->Draw(state_, width_, height_, area);
+}
+
+bool WidgetView::Resize(int width, int height) {
+  if (width_ == width && height_ == height) return false;
+  surface_->Resize(width, height);
+  width_ = width;
+  height_ = height;
+  bucket_ = icon::Bucket(state_, width_, height_);
+  return true;
+}
+
+bool WidgetView::SetState(const IconState& state, int64_t origin) {
+  auto samples = history_ ? history_->GetCount() : 0;
+  auto bucket = icon::Bucket(state, width_, height_);
+  auto same = state_.icon == state.icon && bucket_ == bucket && samples_ == samples;
+  state_ = state;
+  bucket_ = bucket;
+  samples_ = samples;
+  if (same) return false;
+  if (!origin_) origin_ = origin;
+  return true;
+}
+
+void WidgetView::SetHistory(const history::Ring* history) {
+  history_ = history;
+  samples_ = history_ ? history_->GetCount() : 0;
+}
+
+bool WidgetView::Hide(Hidden reason, bool hidden) {
+  auto visible = IsVisible();
+  if (hidden) hidden_ |= reason;
+  else hidden_ &= ~reason;
+  return visible != IsVisible();
+}
+
+bool WidgetView::IsVisible() const {
+  return !hidden_;
+}
+
+void WidgetView::Present(int64_t time) {
+  if (!origin_) return;
+  if (width_ > 0 && height_ > 0) trace::Record(name_, trace::kLatency, origin_, time);
+  origin_ = 0;
+}
+
+xcb_rectangle_t WidgetView::GetArea() const {
+  return {0, 0, static_cast<uint16_t>(width_), static_cast<uint16_t>(height_)};
+}
+
+bool WidgetView::Damage(const xcb_rectangle_t& area) {
+  if (!dirty_) {
+    dirty_ = true;
+    damage_ = area;
+    return true;
+  }
+  auto right = std::max(damage_.x + damage_.width, area.x + area.width);
+  auto bottom = std::max(damage_.y + damage_.height, area.y + area.height);
+  damage_.x = std::min(damage_.x, area.x);
+  damage_.y = std::min(damage_.y, area.y);
+  damage_.width = right - damage_.x;
+  damage_.height = bottom - damage_.y;
+  return false;
+}
+
+void WidgetView::Repair() {
+  Update(damage_);
+  dirty_ = false;
+}
+
+Surface& WidgetView::GetSurface() {
+  return *surface_;
+}
+
+bool WidgetView::operator==(xcb_window_t op) const {
+  return surface_->GetWindow() == op;
+}
+
+Compositor::Compositor(xcb_connection_t* conn, PixmapCache& cache) :
+    conn_(conn),
+    cache_(cache),
+    window_(CreateWindow(conn, 1, 1)),
+    context_(CreateContext(conn)),
+    width_(1), height_(1), size_(0),
+    requested_(0) {}
+
+Compositor::~Compositor() {
+  xcb_free_gc(conn_, context_);
+  xcb_destroy_window(conn_, window_);
+}
+
+xcb_point_t Compositor::GetPosition(size_t index) const {
+  auto offset = static_cast<int16_t>(index * size_);
+  if (width_ >= height_) return {offset, static_cast<int16_t>((height_ - size_) / 2)};
+  return {static_cast<int16_t>((width_ - size_) / 2), offset};
+}
+
+// Asks for room for every slot once per count, trays keeping icons square ignore it and the slots
+// shrink instead.
+void Compositor::Fit() {
+  auto size = std::min(width_, height_);
+  if (slots_.empty() || size <= 1 || requested_ == slots_.size()) return;
+  requested_ = slots_.size();
+  if (width_ >= height_) width_ = size * slots_.size();
+  else height_ = size * slots_.size();
+  uint32_t values[] = {static_cast<uint32_t>(width_), static_cast<uint32_t>(height_)};
+  xcb_configure_window(conn_, window_, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+}
+
+void Compositor::Layout() {
+  Fit();
+  auto count = std::max<int>(slots_.size(), 1);
+  size_ = width_ >= height_ ? std::min(height_, width_ / count) : std::min(width_, height_ / count);
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    auto position = GetPosition(i);
+    slots_[i].surface->Move(position.x, position.y);
+  }
+  // Uncovered parts keep the background, views repaint their slots on the next frame.
+  xcb_clear_area(conn_, false, window_, 0, 0, 0, 0);
+}
+
+std::unique_ptr<WidgetView> Compositor::Add(const char* name) {
+  auto surface = std::make_unique<SlotSurface>(conn_, cache_, window_, context_);
+  auto slot = surface.get();
+  auto result = std::make_unique<WidgetView>(name, std::move(surface));
+  slots_.push_back({result.get(), slot});
+  Layout();
+  return result;
+}
+
+void Compositor::Remove(const WidgetView* view) {
+  slots_.erase(std::remove_if(slots_.begin(), slots_.end(), [view](const auto& op) {
+    return op.view == view;
+  }), slots_.end());
+  Layout();
+}
+
+bool Compositor::Resize(int width, int height) {
+  if (width_ == width && height_ == height) return false;
+  width_ = width;
+  height_ = height;
+  Layout();
+  return true;
+}
+
+size_t Compositor::GetCount() const {
+  return slots_.size();
+}
+
+int Compositor::GetSlotSize() const {
+  return size_;
+}
+
+xcb_window_t Compositor::GetWindow() const {
+  return window_;
+}
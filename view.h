@@ -0,0 +1,203 @@
+#ifndef LAPS2_VIEW_H_
+#define LAPS2_VIEW_H_
+
+#include "history.h"
+#include "icon.h"
+#include "pixmap.h"
+#include "raster.h"
+#include "util.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <xcb/xcb.h>
+
+// Backend a view draws its icon with.
+class Surface : public util::NonCopyable {
+ public:
+  virtual ~Surface() {}
+  virtual void Resize(int width, int height) {}
+  // Draws the icon scaled to width by height, at least the area has to be updated.
+  virtual void Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) = 0;
+  // Trends change with every sample, surfaces caching icons draw them uncached.
+  virtual void DrawTrend(const Icon& trend, int width, int height, const xcb_rectangle_t& area) {
+    Draw({&trend, 0}, width, height, area);
+  }
+  virtual xcb_window_t GetWindow() const {
+    return XCB_WINDOW_NONE;
+  }
+};
+
+// Unmapped window with a gc for drawing into it.
+class WindowSurface : public Surface {
+ protected:
+  xcb_connection_t* conn_;
+  xcb_window_t window_;
+  xcb_gcontext_t context_;
+
+ public:
+  WindowSurface(xcb_connection_t* conn, int width, int height);
+  ~WindowSurface();
+  xcb_window_t GetWindow() const override;
+};
+
+// Icon polygons are filled directly into the window on every draw.
+class PolygonSurface : public WindowSurface {
+ private:
+  icon::Instance instance_;
+  std::vector<xcb_point_t> points_;
+
+ public:
+  PolygonSurface(xcb_connection_t* conn, int width, int height);
+  void Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) override;
+};
+
+// Icons are rendered into cached pixmaps once and copied into the window.
+class PixmapSurface : public WindowSurface {
+ private:
+  PixmapCache& cache_;
+
+ public:
+  PixmapSurface(xcb_connection_t* conn, PixmapCache& cache, int width, int height);
+  void Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) override;
+  void DrawTrend(const Icon& trend, int width, int height, const xcb_rectangle_t& area) override;
+};
+
+// Slot of a window shared by several views, icons are copied from cached pixmaps at an offset.
+class SlotSurface : public Surface {
+ private:
+  xcb_connection_t* conn_;
+  PixmapCache& cache_;
+  xcb_window_t window_;
+  xcb_gcontext_t context_;
+  int16_t x_;
+  int16_t y_;
+
+ public:
+  SlotSurface(xcb_connection_t* conn, PixmapCache& cache, xcb_window_t window, xcb_gcontext_t context);
+  void Move(int x, int y);
+  void Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) override;
+  void DrawTrend(const Icon& trend, int width, int height, const xcb_rectangle_t& area) override;
+};
+
+// Offscreen 8 bit coverage, needs no display at all.
+class FramebufferSurface : public Surface {
+ private:
+  raster::Rasterizer rasterizer_;
+  icon::Instance instance_;
+  std::vector<uint8_t> pixels_;
+
+ public:
+  void Resize(int width, int height) override;
+  void Draw(const IconState& state, int width, int height, const xcb_rectangle_t& area) override;
+  const std::vector<uint8_t>& GetPixels() const;
+};
+
+// State, size and pending damage of a single icon, drawn by a surface.
+class WidgetView : public util::NonCopyable {
+ public:
+  // Reasons for an icon not to be seen, combined as flags.
+  enum Hidden {
+    kUnmapped = 1,
+    kObscured = 2,
+    kBlanked = 4
+  };
+
+ private:
+  const char* name_;
+  std::unique_ptr<Surface> surface_;
+  int width_;
+  int height_;
+  IconState state_;
+  // Bucket of the state at the current size, kept so the previous icon is never read again. It may
+  // be gone by the time the next state is set.
+  int bucket_;
+  const history::Ring* history_;
+  uint64_t samples_;
+  history::Sparkline sparkline_;
+  int64_t origin_;
+  bool dirty_;
+  xcb_rectangle_t damage_;
+  unsigned hidden_;
+
+ public:
+  WidgetView(const char* name, std::unique_ptr<Surface> surface, int width = -1, int height = -1);
+  void Update(const xcb_rectangle_t& area);
+  bool Resize(int width, int height);
+  // Origin is the wakeup that led to the state, the earliest one not shown yet is kept. Levels
+  // within the same bucket at the current size need no repaint.
+  bool SetState(const IconState& state, int64_t origin = 0);
+  // Shown instead of the icon once it holds samples, every new one repaints. The ring is owned by
+  // the widget.
+  void SetHistory(const history::Ring* history);
+  // Returns true if the view was shown or hidden by the change.
+  bool Hide(Hidden reason, bool hidden);
+  bool IsVisible() const;
+  // Called once the repaint reached the screen.
+  void Present(int64_t time);
+  xcb_rectangle_t GetArea() const;
+  // Returns true if the view had no pending damage before.
+  bool Damage(const xcb_rectangle_t& area);
+  void Repair();
+  Surface& GetSurface();
+  bool operator==(xcb_window_t op) const;
+};
+
+// Single window every view draws into, so a tray embeds and lays out one icon only. Slots are
+// squares along the longer side of the window, each view only repaints its own.
+class Compositor : public util::NonCopyable {
+ private:
+  struct Slot {
+    WidgetView* view;
+    SlotSurface* surface;
+  };
+
+  xcb_connection_t* conn_;
+  PixmapCache& cache_;
+  xcb_window_t window_;
+  xcb_gcontext_t context_;
+  int width_;
+  int height_;
+  int size_;
+  size_t requested_;
+  std::vector<Slot> slots_;
+
+  xcb_point_t GetPosition(size_t index) const;
+  void Fit();
+  void Layout();
+
+ public:
+  Compositor(xcb_connection_t* conn, PixmapCache& cache);
+  ~Compositor();
+  // The view is owned by the caller and has to be removed before it is destroyed. Adding and
+  // removing moves the slots, all views need a full repaint afterwards.
+  std::unique_ptr<WidgetView> Add(const char* name);
+  void Remove(const WidgetView* view);
+  bool Resize(int width, int height);
+  size_t GetCount() const;
+  int GetSlotSize() const;
+  xcb_window_t GetWindow() const;
+
+  template<class F>
+  void ForEach(F function) {
+    for (const auto& it : slots_)
+      function(it.view);
+  }
+
+  // Calls function with every view overlapping the area, translated into view coordinates.
+  template<class F>
+  void Expose(const xcb_rectangle_t& area, F function) {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      auto origin = GetPosition(i);
+      auto left = std::max<int>(area.x, origin.x);
+      auto top = std::max<int>(area.y, origin.y);
+      auto right = std::min<int>(area.x + area.width, origin.x + size_);
+      auto bottom = std::min<int>(area.y + area.height, origin.y + size_);
+      if (left >= right || top >= bottom) continue;
+      function(slots_[i].view, xcb_rectangle_t{static_cast<int16_t>(left - origin.x), static_cast<int16_t>(top - origin.y),
+                                               static_cast<uint16_t>(right - left), static_cast<uint16_t>(bottom - top)});
+    }
+  }
+};
+
+#endif  // LAPS2_VIEW_H_
@@ -1,28 +1,67 @@
 #ifndef LAPS2_WIDGET_H_
 #define LAPS2_WIDGET_H_
 
+#include "event.h"
+#include "history.h"
+#include "icon.h"
 #include "util.h"
 #include <poll.h>
 #include <list>
 #include <vector>
 
-inline bool operator==(const pollfd& a, const pollfd& b) {
-  return a.fd == b.fd;
-}
-
 struct Widget;
 class WidgetList final : public std::list<Widget*>, public util::Singleton<WidgetList> {};
 
 struct Widget {
   virtual void Init(int argc, char** argv) = 0;
-  virtual const uint8_t* GetState() = 0;
-  virtual std::vector<pollfd> GetPollFds() = 0;
+  virtual IconState GetState() = 0;
   virtual void Activate() = 0;
   virtual void Handle(const pollfd& fd) = 0;
+  virtual const char* GetName() = 0;
+
+  // Backends that may stall are run on a worker thread unless LAPS2_WORKERS is 0.
+  virtual bool MayBlock() {
+    return false;
+  }
+
+  // Called on the thread of the widget when its icon is hidden or shown again. Backends may lower
+  // their event rate meanwhile, the state is fetched once the icon is shown.
+  virtual void SetVisible(bool visible) {}
+
+  // Latest levels drawn as a trend. Only read on the main thread, so widgets that may block keep none.
+  virtual const history::Ring* GetHistory() {
+    return nullptr;
+  }
 
   Widget() {
     WidgetList::Get().push_back(this);
   }
+
+  // Must be called before Init, descriptors registered by the widget are dispatched to handler.
+  void Bind(event::Reactor* reactor, event::Handler* handler) {
+    source_ = event::Source(reactor, handler);
+  }
+
+ protected:
+  void Watch(int fd, short events) {
+    source_.Watch(fd, events);
+  }
+
+  void Unwatch(int fd) {
+    source_.Unwatch(fd);
+  }
+
+  // State changed outside of Handle, e.g. from a shared connection.
+  void Notify() {
+    source_.Notify();
+  }
+
+  event::Source& GetSource() {
+    return source_;
+  }
+
+ private:
+  event::Source source_;
 };
 
 #endif  // LAPS2_WIDGET_H_
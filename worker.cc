@@ -0,0 +1,158 @@
+#include "worker.h"
+#include "trace.h"
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+Worker::Context::Context(Widget* widget) :
+    widget(widget),
+    sequence(0),
+    icon(nullptr),
+    level(0),
+    state({nullptr, 0}),
+    origin(0),
+    visible(true),
+    notify_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    stop_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    visible_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    running(true),
+    published(false) {
+  if (notify_fd < 0 || stop_fd < 0 || visible_fd < 0) {
+    for (auto fd : {notify_fd, stop_fd, visible_fd}) {
+      if (fd >= 0) close(fd);
+    }
+    util::ThrowSystemError("Failed to create worker eventfd");
+  }
+}
+
+Worker::Context::~Context() {
+  close(visible_fd);
+  close(stop_fd);
+  close(notify_fd);
+}
+
+void Worker::Context::Run(int argc, char** argv) {
+  try {
+    reactor.Add(stop_fd, POLLIN, this);
+    reactor.Add(visible_fd, POLLIN, this);
+    widget->Bind(&reactor, this);
+    widget->Init(argc, argv);
+  } catch (const std::exception&) {
+    widget->Bind(nullptr, nullptr);
+    started.set_exception(std::current_exception());
+    try {
+      Wake(notify_fd);
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+    }
+    return;
+  }
+  started.set_value();
+  // States are published once per batch of events.
+  while (running) {
+    try {
+      Publish();
+      reactor.Wait(-1);
+    } catch (const std::exception& ex) {
+      util::PrintException(ex);
+    }
+  }
+  widget->Bind(nullptr, nullptr);
+}
+
+// Only the worker thread writes the slot, the main thread is woken up for actual changes only. The
+// first state is always signaled, it may equal the empty slot but completes startup.
+void Worker::Context::Publish() {
+  IconState current;
+  {
+    trace::Span span(widget->GetName(), trace::kGetState);
+    current = widget->GetState();
+  }
+  if (published && state == current) return;
+  published = true;
+  state = current;
+  if (trace::kEnabled) origin.store(trace::GetWakeup(), std::memory_order_relaxed);
+  auto next = sequence.load(std::memory_order_relaxed);
+  sequence.store(next + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  icon.store(current.icon, std::memory_order_relaxed);
+  level.store(current.level, std::memory_order_relaxed);
+  sequence.store(next + 2, std::memory_order_release);
+  Wake(notify_fd);
+}
+
+void Worker::Context::Handle(const pollfd& fd) {
+  if (fd.fd == stop_fd) {
+    running = false;
+    return;
+  }
+  // Only the latest visibility matters, the state is published after the batch.
+  if (fd.fd == visible_fd) {
+    uint64_t counter;
+    if (read(visible_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+      util::ThrowSystemError("Failed to read worker eventfd");
+    widget->SetVisible(visible.load(std::memory_order_relaxed));
+    return;
+  }
+  trace::Span span(widget->GetName(), trace::kHandle);
+  widget->Handle(fd);
+}
+
+Worker::Worker(Widget* widget) : context_(std::make_shared<Context>(widget)) {}
+
+Worker::~Worker() {
+  try {
+    Wake(context_->stop_fd);
+  } catch (const std::exception& ex) {
+    util::PrintException(ex);
+  }
+  if (thread_.joinable()) thread_.join();
+}
+
+std::future<void> Worker::Start(int argc, char** argv) {
+  auto result = context_->started.get_future();
+  auto context = context_;
+  thread_ = std::thread([context, argc, argv] { context->Run(argc, argv); });
+  return result;
+}
+
+void Worker::Abandon() {
+  Wake(context_->stop_fd);
+  thread_.detach();
+}
+
+int Worker::GetFd() const {
+  return context_->notify_fd;
+}
+
+IconState Worker::Read() {
+  uint64_t counter;
+  if (read(context_->notify_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+    util::ThrowSystemError("Failed to read worker eventfd");
+  for (;;) {
+    auto sequence = context_->sequence.load(std::memory_order_acquire);
+    IconState result = {context_->icon.load(std::memory_order_relaxed),
+                        context_->level.load(std::memory_order_relaxed)};
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(sequence & 1) && context_->sequence.load(std::memory_order_relaxed) == sequence) return result;
+  }
+}
+
+int64_t Worker::GetOrigin() const {
+  return context_->origin.load(std::memory_order_relaxed);
+}
+
+void Worker::SetVisible(bool visible) {
+  context_->visible.store(visible, std::memory_order_relaxed);
+  Wake(context_->visible_fd);
+}
+
+unsigned long Worker::GetWakeups() const {
+  return context_->reactor.GetWakeups();
+}
+
+void Worker::Wake(int fd) {
+  uint64_t counter = 1;
+  if (write(fd, &counter, sizeof(counter)) < 0)
+    util::ThrowSystemError("Failed to signal worker eventfd");
+}
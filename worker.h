@@ -0,0 +1,70 @@
+#ifndef LAPS2_WORKER_H_
+#define LAPS2_WORKER_H_
+
+#include "event.h"
+#include "util.h"
+#include "widget.h"
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <thread>
+
+// Runs a widget on its own thread with a private reactor. Every state it reports is published
+// through a single writer seqlock and the render loop is woken up by an eventfd, so nothing the
+// widget does can stall the main thread.
+class Worker : public util::NonCopyable {
+ private:
+  // Everything the thread touches. The thread holds a reference of its own, so an abandoned thread
+  // can finish Init after the worker is gone.
+  struct Context : public event::Handler, public util::NonCopyable {
+    Widget* widget;
+    event::Reactor reactor;
+    // Odd while the worker writes the slot, readers retry until it is even and unchanged.
+    std::atomic<uint32_t> sequence;
+    std::atomic<const Icon*> icon;
+    std::atomic<uint8_t> level;
+    // Latest state published, only used on the worker thread.
+    IconState state;
+    std::atomic<int64_t> origin;
+    std::atomic<bool> visible;
+    int notify_fd;
+    int stop_fd;
+    int visible_fd;
+    bool running;
+    bool published;
+    std::promise<void> started;
+
+    Context(Widget* widget);
+    ~Context();
+    void Run(int argc, char** argv);
+    void Publish();
+    void Handle(const pollfd& fd) override;
+  };
+
+  std::shared_ptr<Context> context_;
+  std::thread thread_;
+
+  static void Wake(int fd);
+
+ public:
+  Worker(Widget* widget);
+  // Joins the thread unless it was abandoned.
+  ~Worker();
+  // Initializes the widget on the worker thread, the future reports errors of Init.
+  // Completion either way is signaled on the descriptor as well.
+  std::future<void> Start(int argc, char** argv);
+  // Detaches a thread stuck in Init, it stops on its own once Init returns.
+  void Abandon();
+  // Readable whenever a new state was published.
+  int GetFd() const;
+  // Called on the main thread, acknowledges the notification and returns the latest state.
+  IconState Read();
+  // Wakeup of the worker that produced the latest state, when tracing.
+  int64_t GetOrigin() const;
+  // Passed on to the widget on its thread.
+  void SetVisible(bool visible);
+  unsigned long GetWakeups() const;
+};
+
+#endif  // LAPS2_WORKER_H_
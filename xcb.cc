@@ -1,32 +1,166 @@
 #include "util.h"
 #include "xcb.h"
+#include <algorithm>
+#include <sys/shm.h>
 
 namespace xcb {
 
-xcb_window_t FindTray(xcb_connection_t* conn, int screen) {
+Atoms::Atoms(xcb_connection_t* conn) :
+    conn_(conn) {}
+
+void Atoms::Prefetch(const std::vector<std::string>& names) {
+  try {
+    using Reply = Pending<xcb_atom_t, xcb_intern_atom_reply_t, xcb_intern_atom_cookie_t>;
+    std::vector<std::pair<const std::string*, Reply>> requests;
+    requests.reserve(names.size());
+    for (const auto& it : names) {
+      if (atoms_.count(it)) continue;
+      requests.emplace_back(&it, Async(&xcb_intern_atom_reply, &xcb_intern_atom_reply_t::atom,
+                                       &xcb_intern_atom, conn_, 1, it.size(), it.data()));
+    }
+    for (auto& it : requests)
+      atoms_[*it.first] = it.second.Get();
+  } catch (const std::exception&) {
+    std::throw_with_nested(std::runtime_error("Can not intern atoms"));
+  }
+}
+
+xcb_atom_t Atoms::Get(const std::string& name) {
+  Prefetch({name});
+  return atoms_.at(name);
+}
+
+std::string TraySelection(int screen) {
+  return "_NET_SYSTEM_TRAY_S" + std::to_string(screen);
+}
+
+xcb_window_t FindTray(xcb_connection_t* conn, Atoms& atoms, int screen) {
   try {
-    const auto& name = "_NET_SYSTEM_TRAY_S" + std::to_string(screen);
-    auto atom = xcb::Sync(&xcb_intern_atom_reply, &xcb_intern_atom_reply_t::atom,
-                          &xcb_intern_atom, conn, 1, name.size(), name.data());
     return xcb::Sync(&xcb_get_selection_owner_reply, &xcb_get_selection_owner_reply_t::owner,
-                     &xcb_get_selection_owner, conn, atom);
+                     &xcb_get_selection_owner, conn, atoms.Get(TraySelection(screen)));
   } catch (const std::exception&) {
     std::throw_with_nested(std::runtime_error("Can not find tray"));
   }
 }
 
-void Embed(xcb_connection_t* conn, xcb_window_t tray, xcb_window_t win) {
-  static const char atom_name[] = "_NET_SYSTEM_TRAY_OPCODE";
+void Embed(xcb_connection_t* conn, Atoms& atoms, xcb_window_t tray, xcb_window_t win) {
   xcb_client_message_event_t evt = {0};
   evt.response_type = XCB_CLIENT_MESSAGE;
   evt.format = 32;
   evt.window = tray;
-  evt.type = xcb::Sync(&xcb_intern_atom_reply, &xcb_intern_atom_reply_t::atom,
-                       &xcb_intern_atom, conn, 1, util::Length(atom_name) - 1, atom_name);
+  evt.type = atoms.Get("_NET_SYSTEM_TRAY_OPCODE");
   evt.data.data32[0] = XCB_CURRENT_TIME;
   evt.data.data32[1] = 0;
   evt.data.data32[2] = win;
   xcb_send_event(conn, 0, tray, XCB_EVENT_MASK_NO_EVENT, reinterpret_cast<char*>(&evt));
 }
 
+namespace {
+
+// Large enough for common tray icons, bigger ones grow the segment when reserved.
+const size_t kInitialSegmentSize = 64 * 64 * sizeof(uint32_t);
+
+}  // namespace
+
+Image::Image(xcb_connection_t* conn) :
+    conn_(conn),
+    shared_(false),
+    completion_(0),
+    segments_(),
+    reserved_(nullptr) {
+  auto extension = xcb_get_extension_data(conn, &xcb_shm_id);
+  if (!extension || !extension->present) return;
+  completion_ = extension->first_event + XCB_SHM_COMPLETION;
+  shared_ = Attach(segments_[0], kInitialSegmentSize, true) && Attach(segments_[1], kInitialSegmentSize, false);
+  if (!shared_) Detach(segments_[0]);
+}
+
+Image::~Image() {
+  for (auto& it : segments_)
+    Detach(it);
+}
+
+void Image::Detach(Segment& segment) {
+  if (!segment.data) return;
+  xcb_shm_detach(conn_, segment.id);
+  shmdt(segment.data);
+  segment = {0, nullptr, 0, false};
+}
+
+// Only the first attach is checked, later ones would fail for the same reasons only.
+bool Image::Attach(Segment& segment, size_t size, bool checked) {
+  Detach(segment);
+  auto id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (id < 0) return false;
+  auto data = shmat(id, nullptr, 0);
+  if (data == reinterpret_cast<void*>(-1)) {
+    shmctl(id, IPC_RMID, nullptr);
+    return false;
+  }
+  auto segment_id = xcb_generate_id(conn_);
+  if (checked) {
+    // Fails for remote displays, the segment can be marked for removal once the server holds it.
+    std::unique_ptr<xcb_generic_error_t, decltype(&free)> error(
+        xcb_request_check(conn_, xcb_shm_attach_checked(conn_, segment_id, id, 1)), &free);
+    shmctl(id, IPC_RMID, nullptr);
+    if (error) {
+      shmdt(data);
+      return false;
+    }
+  } else {
+    // Linux lets the server attach a segment marked for removal as long as it is mapped here.
+    xcb_shm_attach(conn_, segment_id, id, 1);
+    shmctl(id, IPC_RMID, nullptr);
+  }
+  segment = {segment_id, static_cast<uint8_t*>(data), size, false};
+  return true;
+}
+
+uint32_t* Image::Reserve(int width, int height) {
+  size_t size = width * height * sizeof(uint32_t);
+  reserved_ = nullptr;
+  if (shared_) {
+    for (auto& it : segments_) {
+      if (it.busy) continue;
+      if (size <= it.size || Attach(it, size, false)) reserved_ = &it;
+      break;
+    }
+  }
+  if (reserved_) return reinterpret_cast<uint32_t*>(reserved_->data);
+  local_.resize(size);
+  return reinterpret_cast<uint32_t*>(local_.data());
+}
+
+void Image::Put(xcb_drawable_t drawable, xcb_gcontext_t gc, uint8_t depth, int width, int height) {
+  if (reserved_) {
+    // The segment is left alone until the server reports it has read it.
+    xcb_shm_put_image(conn_, drawable, gc, width, height, 0, 0, width, height, 0, 0,
+                      depth, XCB_IMAGE_FORMAT_Z_PIXMAP, 1, reserved_->id, 0);
+    reserved_->busy = true;
+    reserved_ = nullptr;
+    return;
+  }
+  size_t stride = width * sizeof(uint32_t);
+  size_t max_rows = (xcb_get_maximum_request_length(conn_) * 4 - sizeof(xcb_put_image_request_t)) / stride;
+  for (int row = 0; row < height;) {
+    auto rows = std::min<int>(height - row, max_rows);
+    xcb_put_image(conn_, XCB_IMAGE_FORMAT_Z_PIXMAP, drawable, gc, width, rows, 0, row, 0,
+                  depth, rows * stride, local_.data() + row * stride);
+    row += rows;
+  }
+}
+
+bool Image::Handle(xcb_generic_event_t* evt) {
+  if (!shared_ || (evt->response_type & ~0x80) != completion_) return false;
+  auto segment = reinterpret_cast<xcb_shm_completion_event_t*>(evt)->shmseg;
+  for (auto& it : segments_) {
+    if (it.id == segment) it.busy = false;
+  }
+  return true;
+}
+
+bool Image::IsShared() const {
+  return shared_;
+}
+
 }  // namespace xcb
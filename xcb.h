@@ -1,29 +1,117 @@
 #ifndef LAPS2_XCB_H_
 #define LAPS2_XCB_H_
 
+#include "util.h"
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <xcb/shm.h>
 #include <xcb/xcb.h>
 
 namespace xcb {
 
+// Reply of a request sent by Async, collected later so that several requests share a round-trip.
+template<class R, class S, class C>
+class Pending {
+ private:
+  using ReplyFn = S* (*)(xcb_connection_t*, C, xcb_generic_error_t**);
+  xcb_connection_t* conn_;
+  ReplyFn reply_fn_;
+  R S::*ptr_;
+  C cookie_;
+  bool pending_;
+
+ public:
+  Pending(xcb_connection_t* conn, ReplyFn reply_fn, R S::*ptr, C cookie) :
+      conn_(conn), reply_fn_(reply_fn), ptr_(ptr), cookie_(cookie), pending_(true) {}
+
+  Pending(const Pending&) = delete;
+
+  Pending(Pending&& op) noexcept :
+      conn_(op.conn_), reply_fn_(op.reply_fn_), ptr_(op.ptr_), cookie_(op.cookie_), pending_(op.pending_) {
+    op.pending_ = false;
+  }
+
+  ~Pending() {
+    if (pending_) xcb_discard_reply(conn_, cookie_.sequence);
+  }
+
+  R Get() {
+    if (!pending_) throw std::logic_error("Reply already collected");
+    pending_ = false;
+    xcb_generic_error_t* error = nullptr;
+    std::unique_ptr<S, decltype(&free)> result(reply_fn_(conn_, cookie_, &error), &free);
+    std::unique_ptr<xcb_generic_error_t, decltype(&free)> error_holder(error, &free);
+    if (error) throw std::runtime_error("Error " + std::to_string(error->error_code));
+    if (!result) throw std::runtime_error("Unknown error");
+    return result.get()->*ptr_;
+  }
+};
+
+template<class R, class S, class F1, class F2, class... Args>
+static auto Async(F2 f2, R S::*ptr, F1 f1, xcb_connection_t* conn, Args&&... args) {
+  auto cookie = f1(conn, std::forward<Args>(args)...);
+  return Pending<R, S, decltype(cookie)>(conn, f2, ptr, cookie);
+}
+
 template<class R, class S, class F1, class F2, class... Args>
 static R Sync(F2 f2, R S::*ptr, F1 f1, xcb_connection_t* conn, Args&&... args) {
   try {
-    xcb_generic_error_t* error;
-    auto cookie = f1(conn, std::forward<Args>(args)...);
-    auto temp = f2(conn, cookie, &error);
-    using PtrType = typename std::remove_pointer<decltype(temp)>::type;
-    std::unique_ptr<PtrType, decltype(&free)> result(temp, &free);
-    if (error) throw std::runtime_error("Error " + std::to_string(error->error_code));
-    if (!result) throw std::runtime_error("Unknown error");
-    return result.get()->*ptr;
+    return Async(f2, ptr, f1, conn, std::forward<Args>(args)...).Get();
   } catch (const std::exception&) {
     std::throw_with_nested(std::runtime_error("Sync operation failed"));
   }
 }
 
-xcb_window_t FindTray(xcb_connection_t* conn, int screen);
-void Embed(xcb_connection_t* conn, xcb_window_t tray, xcb_window_t win);
+// Interned atoms shared by all views, missing names are interned in one round-trip.
+class Atoms : public util::NonCopyable {
+ private:
+  xcb_connection_t* conn_;
+  std::unordered_map<std::string, xcb_atom_t> atoms_;
+
+ public:
+  Atoms(xcb_connection_t* conn);
+  void Prefetch(const std::vector<std::string>& names);
+  xcb_atom_t Get(const std::string& name);
+};
+
+std::string TraySelection(int screen);
+xcb_window_t FindTray(xcb_connection_t* conn, Atoms& atoms, int screen);
+void Embed(xcb_connection_t* conn, Atoms& atoms, xcb_window_t tray, xcb_window_t win);
+
+// Client side 32 bpp ZPixmap image, shared with the server through MIT-SHM when available. Two
+// segments are used in turn, each one is busy until the server reports the put as completed.
+// Nothing waits for the server, images are sent through the connection while both are busy.
+class Image : public util::NonCopyable {
+ private:
+  struct Segment {
+    xcb_shm_seg_t id;
+    uint8_t* data;
+    size_t size;
+    bool busy;
+  };
+
+  xcb_connection_t* conn_;
+  bool shared_;
+  uint8_t completion_;
+  Segment segments_[2];
+  Segment* reserved_;
+  std::vector<uint8_t> local_;
+
+  void Detach(Segment& segment);
+  bool Attach(Segment& segment, size_t size, bool checked);
+
+ public:
+  // Checks once that the server can attach segments at all, remote displays can not.
+  Image(xcb_connection_t* conn);
+  ~Image();
+  uint32_t* Reserve(int width, int height);
+  void Put(xcb_drawable_t drawable, xcb_gcontext_t gc, uint8_t depth, int width, int height);
+  // Returns true for the completion events of the image's puts.
+  bool Handle(xcb_generic_event_t* evt);
+  bool IsShared() const;
+};
 
 using Connection = std::unique_ptr<xcb_connection_t, decltype(&xcb_disconnect)>;
 using Event = std::unique_ptr<xcb_generic_event_t, decltype(&free)>;